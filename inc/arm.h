@@ -3,6 +3,9 @@
 
 #include <stdint.h>
 
+/* Cortex-A53 L1/L2 data cache line size. */
+#define CACHELINE 64
+
 static inline void
 delay(int32_t count)
 {
@@ -34,6 +37,15 @@ timestamp()
     return t;
 }
 
+/* Frequency of the system counter read by timestamp(), in Hz. */
+static inline uint64_t
+timerfreq()
+{
+    uint64_t f;
+    asm volatile ("mrs %[freq], cntfrq_el0" : [freq]"=r"(f));
+    return f;
+}
+
 static inline void
 put32(uint64_t p, uint32_t x)
 {
@@ -60,6 +72,26 @@ cli()
     asm volatile("msr daif, %[x]" : : [x]"r"(0xF << 6));
 }
 
+/* Return whether IRQs are unmasked on this core. */
+static inline int
+intr_get()
+{
+    uint64_t daif;
+    asm volatile("mrs %[x], daif" : [x]"=r"(daif));
+    return !(daif & (1 << 7));
+}
+
+/*
+ * Wait for interrupt. The core wakes up when an IRQ is pending even
+ * if IRQs are masked, so callers can check for work with IRQs off
+ * and then wfi() without missing a wakeup.
+ */
+static inline void
+wfi()
+{
+    asm volatile("dsb sy; wfi" : : : "memory");
+}
+
 /* Brute-force data and instruction synchronization barrier. */
 static inline void
 disb()
@@ -6,8 +6,6 @@
 #include "sleeplock.h"
 #include "fs.h"
 
-#define NFILE 100  // Open files per system
-
 struct file {
     enum { FD_NONE, FD_PIPE, FD_INODE } type;
     int ref;
@@ -24,6 +22,7 @@ struct inode {
     uint32_t dev;             // Device number
     uint32_t inum;            // Inode number
     int ref;                  // Reference count
+    struct inode *next;       // Cached inodes, protected by icache.lock
     struct sleeplock lock;    // Protects everything below here
     int valid;                // Inode has been read from disk?
 
@@ -51,7 +50,7 @@ int             dirlink(struct inode *, char *, uint32_t);
 struct inode *  dirlookup(struct inode *, char *, size_t *);
 struct inode *  ialloc(uint32_t, short);
 struct inode *  idup(struct inode *);
-void            iinit(int dev);
+void            iinit();
 void            ilock(struct inode *);
 void            iput(struct inode *);
 void            iunlock(struct inode *);
@@ -64,6 +63,7 @@ void            stati(struct inode *, struct stat *);
 ssize_t         readi(struct inode *, char *, size_t, size_t);
 ssize_t         writei(struct inode *, char *, size_t, size_t);
 
+void            fileinit();
 struct file *   filealloc();
 struct file *   filedup(struct file *f);
 void            fileclose(struct file *f);
@@ -83,6 +83,9 @@ int sys_mkdirat();
 int sys_mknodat();
 int sys_chdir();
 int sys_exec();
+int sys_mmap();
+int sys_munmap();
+int sys_mprotect();
 
 int execve(const char *path, char *const argv[], char *const envp[]);
 struct inode*   create(char* path, short type, short major, short minor);
@@ -9,7 +9,6 @@
 
 // Kernel only
 #define NDEV            10                  // Maximum major device number
-#define NINODE          50                  // Maximum number of active i-nodes
 #define MAXOPBLOCKS     10                  // Max # of blocks any FS op writes
 #define NBUF            (MAXOPBLOCKS*3)     // Size of disk block cache
 
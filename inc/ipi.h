@@ -0,0 +1,22 @@
+#ifndef INC_IPI_H
+#define INC_IPI_H
+
+#include <stdint.h>
+
+#define IPI_MBOX        0           /* Mailbox used for IPIs */
+
+/* Inter-processor interrupt messages, one bit each. */
+#define IPI_WAKEUP      (1 << 0)    /* Leave wfi and look for work */
+#define IPI_RESCHED     (1 << 1)    /* Set need_resched */
+#define IPI_CALL        (1 << 2)    /* Run queued smp_call_function()s */
+
+void ipi_init();
+void ipi_send(int cpu, int msg);
+void ipi_intr();
+void smp_send_reschedule(int cpu);
+void smp_call_function(uint64_t mask, void (*fn)(void *), void *arg);
+void smp_call_function_single(int cpu, void (*fn)(void *), void *arg);
+void tlb_shootdown(uint64_t va, uint64_t len);
+void test_ipi();
+
+#endif
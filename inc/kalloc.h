@@ -1,10 +1,24 @@
 #ifndef KERN_KALLOC_H
 #define KERN_KALLOC_H
 
+/* Buddy allocator manages blocks of 2^0 .. 2^(MAX_ORDER-1) pages. */
+#define MAX_ORDER 11
+
 void alloc_init();
+void alloc_init_cpu();
 char *kalloc();
+char *kalloc_nozero();
+void kalloc_zero_refill();
 void kfree(char*);
+char *kalloc_pages(int order);
+void kfree_pages(char *, int order);
 void free_range(void *, void *);
 void check_free_list();
+int kalloc_set_pcp(int);
+void page_get(char *);
+void page_put(char *);
+int page_shared(char *);
+
+void test_kalloc();
 
 #endif /* !KERN_KALLOC_H */
@@ -24,6 +24,10 @@
 #define PGSIZE (1 << L3SHIFT)
 #define BKSIZE (1 << L2SHIFT)
 
+/* Pages that share one TLB entry when mapped with PTE_CONT, as 2^CONT_ORDER */
+#define CONT_ORDER 4
+#define CONT_SIZE (PGSIZE << CONT_ORDER)
+
 #define PTX(level, va) (((uint64_t)(va) >> (39 - 9 * level)) & 0x1FF)
 #define L0X(va) (((uint64_t)(va) >> L0SHIFT) & 0x1FF)
 #define L1X(va) (((uint64_t)(va) >> L1SHIFT) & 0x1FF)
@@ -41,10 +45,13 @@
 #define PTE_RO       (1<<7)      /* read-only */
 #define PTE_SH       (3<<8)      /* Shareability */
 #define PTE_AF       (1<<10)     /* P2066 access flags */
+#define PTE_CONT     (1ULL<<52)  /* contiguous hint: part of an aligned CONT_SIZE run */
+#define PTE_COW      (1ULL<<55)  /* Software: read-only copy-on-write page */
+#define PTE_DIRTY    (1ULL<<56)  /* Software: written through a shared file mapping */
 /* Get address to next-lavel table */
-/* Address in page table or page directory entry */
-#define PTE_ADDR(pte)   ((uint64_t)(pte) & ~0xFFF)
-#define PTE_FLAGS(pte)  ((unsigned)(pte) &  0xFFF)
+/* Address in page table or page directory entry, bits [47:12] */
+#define PTE_ADDR(pte)   ((uint64_t)(pte) & 0xFFFFFFFFF000ULL)
+#define PTE_FLAGS(pte)  ((uint64_t)(pte) & ~0xFFFFFFFFF000ULL)
 
 /* P2061 */
 #define MM_TYPE_BLOCK       PTE_P | PTE_BLOCK
@@ -99,4 +106,8 @@
 #define UADDR_BITS	28					// maximum user-application memory, 256MB
 #define UADDR_SZ	(1 << UADDR_BITS)			// maximum user address space size
 
+/* mmap() area, above the clock page; addresses fit in a syscall's int return */
+#define MMAP_BASE	0x40000000
+#define MMAP_TOP	0x80000000
+
 #endif
@@ -0,0 +1,15 @@
+#ifndef INC_PCACHE_H
+#define INC_PCACHE_H
+
+#include <stdint.h>
+
+struct inode;
+
+void pcache_init();
+char *pcache_get(struct inode *, uint64_t off, int shared);
+void pcache_write(struct inode *, char *src, uint64_t off, uint64_t n);
+void pcache_read(struct inode *, char *dst, uint64_t off, uint64_t n);
+void pcache_invalidate(struct inode *);
+void pcache_dump();
+
+#endif
@@ -5,17 +5,26 @@
 
 #include "arm.h"
 #include "trap.h"
+#include "spinlock.h"
 
 #define NCPU   4        /* maximum number of CPUs */
+#define CPU_BIT(c)      (1ULL << (c))
+#define CPUMASK_ALL     (CPU_BIT(NCPU) - 1)
 #define NPROC 64        /* maximum number of processes */
 #define NOFILE 16       /* open files per process */
+#define NVMA 16         /* mappings per process */
 #define KSTACKSIZE 4096 /* size of per-process kernel stack */
+#define NZERO 20        /* nice values range from -NZERO to NZERO-1 */
+#define NRTPRIO 100     /* real-time priorities are 1..NRTPRIO-1 */
 
 #define thiscpu (&cpus[cpuid()])
 
 struct cpu {
     struct context *scheduler;  /* swtch() here to enter scheduler */
     struct proc *proc;          /* The process running on this cpu or null */
+    int noff;                   /* Depth of push_off() nesting */
+    int intena;                 /* Were interrupts enabled before push_off()? */
+    int need_resched;           /* A process that outranks proc is queued */
 };
 
 extern struct cpu cpus[NCPU];
@@ -49,7 +58,34 @@ struct context {
 
 enum procstate { UNUSED, EMBRYO, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
+#define VMA_WRITE    0x1    /* Writable, copy-on-write unless shared */
+#define VMA_READ     0x2
+#define VMA_SHARED   0x4    /* Writes reach the file and the other mappers */
+#define VMA_MAYWRITE 0x8    /* mprotect() may add VMA_WRITE */
+
+/*
+ * A mapping of a file or of anonymous memory, faulted in a page at a
+ * time by uvm_fault(). exec() sets one up per loadable segment, and
+ * mmap() adds more in the mmap area.
+ */
+struct vma {
+    uint64_t start;          /* Page-aligned */
+    uint64_t end;            /* Page-aligned, exclusive; 0 if unused */
+    uint64_t fend;           /* File data ends here, zeros follow */
+    uint64_t off;            /* File offset of start */
+    int flags;
+    struct inode *ip;        /* 0 for anonymous memory */
+};
+
+/*
+ * p->lock protects p->state, and is held from sched() until the
+ * scheduler that switched away from p is off its stack. p->chan
+ * and p->wq_next are protected by the lock of the wait queue p
+ * sleeps on, p->rq_next by the run queue p is on.
+ */
 struct proc {
+    struct spinlock lock;
+
     uint64_t sz;             /* Size of process memory (bytes)          */
     uint64_t *pgdir;         /* Page table                              */
     char *kstack;            /* Bottom of kernel stack for this process */
@@ -59,25 +95,55 @@ struct proc {
     struct trapframe *tf;    /* Trapframe for current syscall           */
     struct context *context; /* swtch() here to run process             */
     void *chan;              /* If non-zero, sleeping on chan           */
+    struct proc *wq_next;    /* Next sleeper in chan's wait queue       */
+    struct proc *rq_next;    /* Next process in the same run queue      */
+    int cpu;                 /* CPU whose run queue p goes back to      */
+    uint64_t cpumask;        /* CPUs p may run on                       */
+    uint64_t last_ran;       /* timestamp() when p last stopped running */
+    int nice;                /* -NZERO..NZERO-1, bounds the MLFQ level  */
+    int prio;                /* MLFQ level, 0 runs first                */
+    int slice;               /* Ticks used at the current level         */
+    uint64_t epoch;          /* Last priority boost applied to p        */
+    int policy;              /* SCHED_OTHER, SCHED_FIFO or SCHED_RR     */
+    int rtprio;              /* Real-time priority, 0 for SCHED_OTHER   */
     int killed;              /* If non-zero, have been killed           */
     char name[16];           /* Process name (debugging)                */
 
     struct file *ofile[NOFILE];  /* Open files */
     struct inode *cwd;           /* Current directory */
+    struct vma vma[NVMA];        /* File mappings */
 };
 
+/*
+ * With kernel preemption the caller may move to another CPU at any
+ * point, so cpu->proc is read with preemption off.
+ */
 static inline struct proc *
 thisproc()
 {
-    return thiscpu->proc;
+    struct proc *p;
+
+    push_off();
+    p = thiscpu->proc;
+    pop_off();
+    return p;
 }
 
 void proc_init();
 void user_init();
-void user_idle_init();
 void scheduler();
 
 void yield();
+void proc_tick();
+int setpriority(int pid, int nice);
+int getpriority(int pid, int *nice);
+int proc_timeslice(int pid);
+int setaffinity(int pid, uint64_t mask);
+int getaffinity(int pid, uint64_t *mask);
+int setscheduler(int pid, int policy, int rtprio);
+int getscheduler(int pid, int *policy, int *rtprio);
+void preempt_check();
+void cond_resched();
 void exit();
 int fork();
 int wait();
@@ -92,6 +158,17 @@ size_t sys_brk();
 int sys_clone();
 int sys_wait4();
 int sys_exit();
+int sys_setpriority();
+int sys_getpriority();
+int sys_sched_rr_get_interval();
+int sys_clock_gettime();
+int sys_nanosleep();
+int sys_clock_nanosleep();
+int sys_sched_setaffinity();
+int sys_sched_getaffinity();
+int sys_sched_setscheduler();
+int sys_sched_getscheduler();
+int sys_sched_getparam();
 
 
 #endif
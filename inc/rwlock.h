@@ -0,0 +1,25 @@
+#ifndef INC_RWLOCK_H
+#define INC_RWLOCK_H
+
+#include <stdint.h>
+
+/*
+ * Spinning reader-writer lock for read-mostly tables.
+ * Any number of readers can hold the lock at once, or one writer.
+ * A waiting writer holds back new readers so it cannot starve.
+ * Like a spinlock, it masks interrupts on the local core while held,
+ * and it must not be held across sleep().
+ */
+struct rwlock {
+    volatile int32_t cnt;       /* Readers inside, or -1 for a writer */
+    volatile uint32_t wwait;    /* Writers waiting to get in */
+    char *name;                 /* Name of lock. */
+};
+
+void initrwlock(struct rwlock *, char *);
+void read_acquire(struct rwlock *);
+void read_release(struct rwlock *);
+void write_acquire(struct rwlock *);
+void write_release(struct rwlock *);
+
+#endif
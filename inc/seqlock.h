@@ -0,0 +1,63 @@
+#ifndef INC_SEQLOCK_H
+#define INC_SEQLOCK_H
+
+#include <stdint.h>
+
+#include "spinlock.h"
+
+/*
+ * Sequence lock for small, rarely written data.
+ * Writers serialize on lock and bump seq before and after the
+ * update, so seq is odd while a write is in progress. Readers take
+ * no lock: they copy the data out between read_seqbegin() and
+ * read_seqretry(), and copy again if a writer got in between.
+ *
+ *     do {
+ *         s = read_seqbegin(&sl);
+ *         copy = data;
+ *     } while (read_seqretry(&sl, s));
+ */
+struct seqlock {
+    volatile uint32_t seq;
+    struct spinlock lock;
+};
+
+static inline void
+initseqlock(struct seqlock *sl, char *name)
+{
+    sl->seq = 0;
+    initlock(&sl->lock, name);
+}
+
+static inline uint32_t
+read_seqbegin(struct seqlock *sl)
+{
+    uint32_t s;
+    while ((s = __atomic_load_n(&sl->seq, __ATOMIC_ACQUIRE)) & 1)
+        ;
+    return s;
+}
+
+static inline int
+read_seqretry(struct seqlock *sl, uint32_t s)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&sl->seq, __ATOMIC_RELAXED) != s;
+}
+
+static inline void
+write_seqlock(struct seqlock *sl)
+{
+    acquire(&sl->lock);
+    __atomic_store_n(&sl->seq, sl->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void
+write_sequnlock(struct seqlock *sl)
+{
+    __atomic_store_n(&sl->seq, sl->seq + 1, __ATOMIC_RELEASE);
+    release(&sl->lock);
+}
+
+#endif
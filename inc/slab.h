@@ -0,0 +1,52 @@
+#ifndef INC_SLAB_H
+#define INC_SLAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arm.h"
+#include "spinlock.h"
+#include "proc.h"
+
+#define SLAB_CPU_MAX 16     /* Objects cached per CPU */
+
+struct slab;
+
+/*
+ * Per-CPU object magazine, plus statistics that are only ever
+ * updated by the owning CPU.
+ */
+struct kmem_cache_cpu {
+    void *objs[SLAB_CPU_MAX];
+    int n;
+    uint64_t nalloc;
+    uint64_t nfree;
+} __attribute__((aligned(CACHELINE)));
+
+/*
+ * A cache of equally sized kernel objects carved out of whole pages.
+ * Objects handed out by kmem_cache_alloc() are in the state left by
+ * ctor, which runs once when an object's slab is created, and must
+ * be returned to that state before kmem_cache_free().
+ */
+struct kmem_cache {
+    char *name;
+    size_t size;                /* Object size, including padding */
+    int objs_per_slab;
+    void (*ctor)(void *);
+
+    struct spinlock lock;       /* Protects the slab lists below */
+    struct slab *partial;       /* Slabs with at least one free object */
+    struct slab *full;          /* Slabs with no free objects */
+    uint64_t nslabs;
+
+    struct kmem_cache_cpu cpu[NCPU];
+    struct kmem_cache *next;    /* All caches, for kmem_cache_dump() */
+};
+
+void kmem_cache_init(struct kmem_cache *, char *name, size_t size, void (*ctor)(void *));
+void *kmem_cache_alloc(struct kmem_cache *);
+void kmem_cache_free(struct kmem_cache *, void *);
+void kmem_cache_dump();
+
+#endif
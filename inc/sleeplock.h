@@ -1,18 +1,31 @@
 #ifndef INC_SLEEPLOCK_H
 #define INC_SLEEPLOCK_H
 
+#include <stdint.h>
+
 #include "spinlock.h"
 #include "proc.h"
 
-/* Long-term locks for processes */
+/*
+ * Long-term locks for processes.
+ * A process that finds the lock held spins for a few microseconds
+ * as long as the holder is running on another CPU, and only sleeps
+ * when the holder is blocked itself or keeps the lock for longer.
+ */
 struct sleeplock {
     int locked;         /* Is the lock held? */
     struct spinlock lk; /* Spinlock protecting this sleep lock */
     int pid;
+    struct proc *owner; /* Process holding the lock */
+
+    /* Statistics, protected by lk: */
+    uint64_t nspin;     /* Contended acquisitions won by spinning */
+    uint64_t nsleep;    /* Contended acquisitions that had to sleep */
 };
 
 void initsleeplock(struct sleeplock *lk, char *name);
 void acquiresleep(struct sleeplock *lk);
 void releasesleep(struct sleeplock *lk);
 int holdingsleep(struct sleeplock *lk);
+void sleeplock_dump();
 #endif
@@ -1,19 +1,53 @@
 #ifndef INC_SPINLOCK_H
 #define INC_SPINLOCK_H
 
-#include "proc.h"
+#include <stdint.h>
 
+struct cpu;
+
+/*
+ * Ticket lock: acquire() takes the next ticket and waits until
+ * owner reaches it, so CPUs get the lock in the order they asked.
+ * An all-zero spinlock is a valid unlocked lock.
+ */
 struct spinlock {
-    volatile int locked;
-    
+    volatile uint32_t next;     /* Next ticket to hand out */
+    volatile uint32_t owner;    /* Ticket now being served */
+
     /* For debugging: */
     char        *name;      /* Name of lock. */
     struct cpu  *cpu;       /* The cpu holding the lock. */
+
+    /* Statistics, only updated by the holder: */
+    uint64_t nacquire;      /* Acquisitions */
+    uint64_t ncontend;      /* Acquisitions that had to wait */
+    uint64_t spin;          /* Counter ticks spent waiting */
 };
 
 int holding(struct spinlock *);
 void acquire(struct spinlock *);
 void release(struct spinlock *);
 void initlock(struct spinlock *, char *);
+void lockstat_dump();
+void push_off();
+void pop_off();
+
+/*
+ * The kernel can be preempted by an interrupt unless the CPU holds a
+ * spinlock or is inside push_off(), so cpu->noff is the preempt
+ * count. Code that uses per-CPU data without a lock brackets it with
+ * preempt_disable() and preempt_enable().
+ */
+static inline void
+preempt_disable()
+{
+    push_off();
+}
+
+static inline void
+preempt_enable()
+{
+    pop_off();
+}
 
 #endif
@@ -7,7 +7,9 @@
 
 int argstr(int, char **);
 int argint(int, uint64_t *);
+int argptr(int, char **, int, int);
 int fetchstr(uint64_t, char **);
+int fetchbuf(uint64_t, uint64_t, int);
 
 int syscall(struct trapframe* tf);
 
@@ -31,6 +31,7 @@
 
 /* SPSR_EL1/2/3, Saved Program Status Register. */
 #define SPSR_MASK_ALL               (7 << 6)
+#define SPSR_I                      (1 << 7)    /* IRQs were masked */
 #define SPSR_EL1h                   (5 << 0)
 #define SPSR_EL2h                   (9 << 0)
 #define SPSR_EL3_VALUE              (SPSR_MASK_ALL | SPSR_EL2h)
@@ -41,8 +42,15 @@
 #define EC_UNKNOWN                  0x00
 #define EC_SVC64                    0x15
 #define EC_DABORT                   0x24
+#define EC_DABORT_EL1               0x25    /* Data abort from EL1 */
 #define EC_IABORT                   0x20
 
 #define ISS_MASK                    0xFFFFFF
 
+/* ISS of a data abort. Instruction aborts share the fault status. */
+#define ISS_WNR                     (1 << 6)    /* Caused by a write */
+#define ISS_DFSC_MASK               0x3C        /* Fault status, level masked off */
+#define DFSC_TRANS                  0x04        /* Translation fault */
+#define DFSC_PERM                   0x0C        /* Permission fault */
+
 #endif
@@ -1,8 +1,32 @@
 #ifndef INC_TIMER_H
 #define INC_TIMER_H
 
+#include <stdint.h>
+
+/*
+ * A one-shot kernel timer. fn runs on the CPU that armed the timer,
+ * from its timer interrupt, once the system counter (timestamp())
+ * reaches expires.
+ */
+struct timer_list {
+    uint64_t expires;                   /* Deadline in counter cycles */
+    void (*fn)(struct timer_list *);
+    struct timer_list *next;
+    struct timer_list **pprev;          /* Non-zero while pending */
+    int cpu;                            /* Wheel the timer is on */
+    int lvl;
+};
+
 void timer_init();
+int timer_intr();
 void timer_reset();
+void timer_stop();
+void timer_set_quantum(uint64_t us);
+uint64_t timer_quantum();
+void timer_setup(struct timer_list *, void (*fn)(struct timer_list *));
+void add_timer(struct timer_list *, uint64_t expires);
+int del_timer(struct timer_list *);
+void timer_sleep_until(uint64_t expires);
 void timer();
 
 #endif
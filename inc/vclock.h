@@ -0,0 +1,24 @@
+#ifndef INC_VCLOCK_H
+#define INC_VCLOCK_H
+
+#include <stdint.h>
+
+/*
+ * Read-only clock data page mapped into every process at VCLOCK_VA,
+ * just above the largest user address space (UADDR_SZ). Together
+ * with EL0 access to cntvct_el0 it lets user code read the time
+ * without a system call:
+ *
+ *   ns since boot = (cntvct_el0 - boot) * 1e9 / freq
+ *
+ * The kernel's clocks use the same origin. This header is shared
+ * with user space and must only depend on <stdint.h>.
+ */
+#define VCLOCK_VA   0x10000000
+
+struct vclock {
+    uint64_t freq;          /* Counter frequency in Hz */
+    uint64_t boot;          /* Counter value at boot */
+};
+
+#endif
@@ -14,8 +14,20 @@ int loaduvm(uint64_t* pgdir, char* addr, struct inode* ip, uint32_t offset, uint
 void clearpteu(uint64_t* pgdir, char* uva);
 char* uva2ka(uint64_t* pgdir, char* uva);
 int copyout(uint64_t* pgdir, uint32_t va, void* p, uint32_t len);
-uint64_t* copyuvm(uint64_t* pgdir, uint32_t sz);
+uint64_t* copyuvm(struct proc* p);
+int uvm_cow(uint64_t* pgdir, uint64_t va);
+int uvm_fault(struct proc* p, uint64_t va, int cansleep);
+int uvm_wfault(struct proc* p, uint64_t va);
+int uvm_populate(struct proc* p, uint64_t va, uint64_t len, int write);
+uint64_t uvm_mmap(struct proc* p, uint64_t addr, uint64_t len, int flags, int fixed,
+                  struct inode* ip, uint64_t off);
+int uvm_munmap(struct proc* p, uint64_t addr, uint64_t len);
+int uvm_mprotect(struct proc* p, uint64_t addr, uint64_t len, int flags);
+void uvm_vma_free(struct proc* p);
 
 uint64_t *pgdir_init();
+void vclock_init();
+
+extern struct vclock *vclock;
 
 #endif
\ No newline at end of file
@@ -21,13 +21,20 @@
 
 #include "spinlock.h"
 #include "sleeplock.h"
+#include "rwlock.h"
 #include "buf.h"
 #include "console.h"
 #include "sd.h"
 #include "fs.h"
 
+/*
+ * bget() looks a block up holding bcache.lock for reading, and takes
+ * a reference with an atomic increment of b->refcnt, so lookups on
+ * different cores run in parallel. Recycling a buffer and reordering
+ * the list need the lock for writing.
+ */
 struct {
-    struct spinlock lock;
+    struct rwlock lock;
     struct buf buf[NBUF];
 
     // Linked list of all buffers, through prev/next.
@@ -42,7 +49,7 @@ binit()
     /* TODO: Your code here. */
     struct buf* b;
 
-    initlock(&bcache.lock, "bcache");
+    initrwlock(&bcache.lock, "bcache");
 
     bcache.head.prev = &bcache.head;
     bcache.head.next = &bcache.head;
@@ -69,32 +76,37 @@ bget(uint32_t dev, uint32_t blockno)
 {
     /* TODO: Your code here. */
     struct buf* b;
-    acquire(&bcache.lock);
 
-    //from  https://github.com/sudharson14/xv6-OS-for-arm-v8/blob/master/xv6-armv8/bio.c
-loop:
+    read_acquire(&bcache.lock);
     for (b = bcache.head.next; b != &bcache.head; b = b->next) {
+        if (b->dev == dev && b->blockno == blockno) {
+            __atomic_add_fetch(&b->refcnt, 1, __ATOMIC_RELAXED);
+            read_release(&bcache.lock);
+            acquiresleep(&b->lock);
+            return b;
+        }
+    }
+    read_release(&bcache.lock);
 
+    // Not cached; look again under the write lock before recycling.
+    write_acquire(&bcache.lock);
+    for (b = bcache.head.next; b != &bcache.head; b = b->next) {
         if (b->dev == dev && b->blockno == blockno) {
-            if (!holdingsleep(&b->lock)) {
-                b->refcnt++;
-                release(&bcache.lock);
-                acquiresleep(&b->lock);
-                return b;
-            }
-            sleep(b, &bcache.lock);
-            goto loop;
+            b->refcnt++;
+            write_release(&bcache.lock);
+            acquiresleep(&b->lock);
+            return b;
         }
     }
 
+    // Recycle the least recently used unused clean buffer.
     for (b = bcache.head.prev; b != &bcache.head; b = b->prev) {
-        if ((!holdingsleep(&b->lock)) && (b->flags & B_DIRTY) == 0) {
+        if (b->refcnt == 0 && (b->flags & B_DIRTY) == 0) {
             b->dev = dev;
             b->blockno = blockno;
-            // b->flags &= ~B_VALID;//set valid bit to 0
             b->flags = 0;
             b->refcnt = 1;
-            release(&bcache.lock);
+            write_release(&bcache.lock);
             acquiresleep(&b->lock);
             return b;
         }
@@ -138,11 +150,11 @@ void
 brelse(struct buf *b)
 {
     /* TODO: Your code here. */
-    acquire(&bcache.lock);
     if (!holdingsleep(&b->lock))
         panic("brelse");
     releasesleep(&b->lock);
 
+    write_acquire(&bcache.lock);
     if (--b->refcnt == 0) {
         //delete it from the list
         b->next->prev = b->prev;
@@ -153,8 +165,7 @@ brelse(struct buf *b)
         b->prev = &bcache.head;
         bcache.head.next->prev = b;
         bcache.head.next = b;
-        wakeup(b);
     }
-    release(&bcache.lock);
+    write_release(&bcache.lock);
 }
 
@@ -7,6 +7,9 @@
 #include "uart.h"
 #include "spinlock.h"
 #include "file.h"
+#include "slab.h"
+#include "pcache.h"
+#include "timer.h"
 
 #define CONSOLE 1
 
@@ -23,6 +26,10 @@ struct {
 #define C(x)  ((x)-'@')  // Control-x
 #define BACKSPACE 0x100
 
+/* ^T doubles the scheduler tick, wrapping around within these bounds. */
+#define TICK_MIN_US 1000
+#define TICK_MAX_US 100000
+
 static void
 consputc(int c)
 {
@@ -183,7 +190,7 @@ cprintf(const char *fmt, ...)
 void
 console_intr(int (*getc)())
 {
-    int c, doprocdump = 0;
+    int c, doprocdump = 0, doslabdump = 0, dolockdump = 0, dotick = 0;
 
     acquire(&conslock);
     if (panicked >= 0) {
@@ -197,6 +204,15 @@ console_intr(int (*getc)())
             // procdump() locks cons.lock indirectly; invoke later
             doprocdump = 1;
             break;
+        case C('K'):  // Kernel object caches.
+            doslabdump = 1;
+            break;
+        case C('L'):  // Lock contention statistics.
+            dolockdump = 1;
+            break;
+        case C('T'):  // Scheduler tick length.
+            dotick = 1;
+            break;
         case C('U'):  // Kill line.
             while (input.e != input.w && input.buf[(input.e-1) % INPUT_BUF] != '\n') {
                 input.e--;
@@ -225,6 +241,16 @@ console_intr(int (*getc)())
     release(&conslock);
 
     if (doprocdump) procdump();
+    if (doslabdump) {
+        kmem_cache_dump();
+        pcache_dump();
+    }
+    if (dolockdump) lockstat_dump();
+    if (dotick) {
+        uint64_t us = timer_quantum() * 2;
+        timer_set_quantum(us > TICK_MAX_US ? TICK_MIN_US : us);
+        cprintf("console: scheduler tick is %lld us\n", timer_quantum());
+    }
 }
 
 void
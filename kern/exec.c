@@ -26,14 +26,19 @@ execve(const char *path, char *const argv[], char *const envp[])
     int i, off;
     uint64_t argc, sz, sp, ustack[3 + MAXARG + 1], tmp;
     struct proc* curproc = thisproc();
+    struct vma vma[NVMA], *v;
 
+    begin_op();
     if ((ip = namei(path)) == 0) {
+        end_op();
         cprintf("exec: fail\n");
         return -1;
     }
 
     ilock(ip);
     pgdir = 0;
+    memset(vma, 0, sizeof(vma));
+    v = vma;
 
     if (readi(ip, (char*)&elf, 0, sizeof(elf)) < sizeof(elf))
         goto bad;
@@ -48,6 +53,10 @@ execve(const char *path, char *const argv[], char *const envp[])
 
     sz = 0;
 
+    /*
+     * Nothing is read yet: each segment becomes a file mapping whose
+     * pages are faulted in from the page cache on first touch.
+     */
     for (i = 0, off = elf.e_phoff;i < elf.e_phnum;i++, off += sizeof(ph)) {
 
         if (readi(ip, (char*)&ph, off, sizeof(ph)) != sizeof(ph))
@@ -55,16 +64,24 @@ execve(const char *path, char *const argv[], char *const envp[])
 
         if (ph.p_type != PT_LOAD)
             continue;
-        if (ph.p_memsz < ph.p_filesz)
+        if (ph.p_memsz < ph.p_filesz || ph.p_vaddr + ph.p_memsz < ph.p_vaddr)
             goto bad;
-        if ((sz = allocuvm(pgdir, sz, ph.p_vaddr + ph.p_memsz)) == 0)
+        if (ph.p_vaddr + ph.p_memsz >= UADDR_SZ)
             goto bad;
-
-        if (loaduvm(pgdir, (char*)ph.p_vaddr, ip, ph.p_offset, ph.p_filesz) < 0)
+        if ((ph.p_vaddr - ph.p_offset) % PGSIZE != 0 || v == vma + NVMA)
             goto bad;
 
+        v->start = ROUNDDOWN(ph.p_vaddr, PGSIZE);
+        v->end = ROUNDUP(ph.p_vaddr + ph.p_memsz, PGSIZE);
+        v->fend = ph.p_vaddr + ph.p_filesz;
+        v->off = ph.p_offset - (ph.p_vaddr - v->start);
+        v->flags = VMA_READ | ((ph.p_flags & PF_W) ? VMA_WRITE | VMA_MAYWRITE : 0);
+        v->ip = idup(ip);
+        v++;
+        sz = MAX(sz, ph.p_vaddr + ph.p_memsz);
     }
     iunlockput(ip);
+    end_op();
     ip = 0;
 
     sz = ROUNDUP(sz, PGSIZE);
@@ -120,13 +137,15 @@ execve(const char *path, char *const argv[], char *const envp[])
 
     // Commit to the user image.
     oldpgdir = curproc->pgdir;
+    uvm_vma_free(curproc);
+    memmove(curproc->vma, vma, sizeof(vma));
     curproc->pgdir = pgdir;
     curproc->sz = sz;
     curproc->tf->ELR_EL1 = elf.e_entry;
     curproc->tf->SP_EL0 = sp;
 
     uvm_switch(curproc);
-    vm_free(oldpgdir, 1);
+    vm_free(oldpgdir, 0);
     return curproc->tf->x0;
 
 bad:
@@ -135,6 +154,14 @@ bad:
         vm_free(pgdir, 0);
     if (ip) {
         iunlockput(ip);
+        end_op();
+    }
+    for (v = vma; v < vma + NVMA; v++) {
+        if (v->ip) {
+            begin_op();
+            iput(v->ip);
+            end_op();
+        }
     }
     return -1;
 
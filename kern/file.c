@@ -7,37 +7,33 @@
 #include "file.h"
 #include "console.h"
 #include "log.h"
+#include "string.h"
+#include "slab.h"
 
 struct devsw devsw[NDEV];
 struct {
-    struct spinlock lock;
-    struct file file[NFILE];
+    struct spinlock lock;       /* Protects f->ref of every open file */
+    struct kmem_cache cache;
 } ftable;
 
-/* Optional since BSS is zero-initialized. */
 void
 fileinit()
 {
-    /* TODO: Your code here. */
     initlock(&ftable.lock, "ftable");
+    kmem_cache_init(&ftable.cache, "file", sizeof(struct file), 0);
 }
 
 /* Allocate a file structure. */
 struct file *
 filealloc()
 {
-    /* TODO: Your code here. */
     struct file* f;
-    acquire(&ftable.lock);
-    for (f = ftable.file; f < ftable.file + NFILE; f++) {
-        if (f->ref == 0) {
-            f->ref = 1;
-            release(&ftable.lock);
-            return f;
-        }
-    }
-    release(&ftable.lock);
-    return 0;
+
+    if ((f = kmem_cache_alloc(&ftable.cache)) == 0)
+        return 0;
+    memset(f, 0, sizeof(*f));
+    f->ref = 1;
+    return f;
 }
 
 /* Increment ref count for file f. */
@@ -62,7 +58,6 @@ void
 fileclose(struct file *f)
 {
     /* TODO: Your code here. */
-    struct inode* f_inode;
     acquire(&ftable.lock);
     if (f->ref < 1) {
         panic("fileclose: ref %d\n", f->ref);
@@ -72,11 +67,12 @@ fileclose(struct file *f)
         release(&ftable.lock);
         return;
     }
+    release(&ftable.lock);
 
-    f_inode = f->ip;
+    /* Last reference: nobody else can see f any more. */
     if (f->type == FD_INODE) {
         begin_op();
-        iput(f_inode);
+        iput(f->ip);
         end_op();
     }
     else {
@@ -84,8 +80,7 @@ fileclose(struct file *f)
     }
 
     f->type = FD_NONE;
-
-    release(&ftable.lock);
+    kmem_cache_free(&ftable.cache, f);
 }
 
 /* Get metadata about file f. */
@@ -19,10 +19,14 @@
 
 #include "spinlock.h"
 #include "sleeplock.h"
+#include "rwlock.h"
+#include "seqlock.h"
 
 #include "buf.h"
 #include "log.h"
 #include "file.h"
+#include "slab.h"
+#include "pcache.h"
 
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
@@ -31,7 +35,13 @@ static void itrunc(struct inode*);
 
 // There should be one superblock per disk device,
 // but we run with only one device.
-struct superblock sb; 
+// The superblock never changes once the file system is made, so it is
+// read from disk once and then copied out under a seqlock.
+static struct {
+    struct seqlock lock;
+    int dev;                /* Device sb was read from, or -1 */
+    struct superblock sb;
+} sbcache = { .dev = -1 };
 
 /* Read the super block. */
 void
@@ -39,12 +49,28 @@ readsb(int dev, struct superblock *sb)
 {
     /* TODO: Your code here. */
     struct buf* bp;
+    uint32_t s;
+    int hit;
+
+    do {
+        s = read_seqbegin(&sbcache.lock);
+        hit = sbcache.dev == dev;
+        if (hit)
+            memmove(sb, &sbcache.sb, sizeof(*sb));
+    } while (read_seqretry(&sbcache.lock, s));
+    if (hit)
+        return;
 
     bp = bread(dev, 1);
     memmove(sb, bp->data, sizeof(*sb));
     //cprintf("superblock info:\n");
     //cprintf("\nsize:%d\nnblocks:%d\nninodes:%d\nnlog:%d\nlogstart:%d\ninodestart:%d\nbmapstart:%d\n", sb->size, sb->nblocks, sb->ninodes, sb->nlog, sb->logstart, sb->inodestart, sb->bmapstart);
     brelse(bp);
+
+    write_seqlock(&sbcache.lock);
+    memmove(&sbcache.sb, sb, sizeof(*sb));
+    sbcache.dev = dev;
+    write_sequnlock(&sbcache.lock);
 }
 
 /* Zero a block. */
@@ -176,34 +202,45 @@ bfree(int dev, uint32_t b)
  * have locked the inodes involved; this lets callers create
  * multi-step atomic operations.
  *
- * The icache.lock spin-lock protects the allocation of icache
- * entries. Since ip->ref indicates whether an entry is free,
- * and ip->dev and ip->inum indicate which i-node an entry
- * holds, one must hold icache.lock while using any of those fields.
+ * The icache.lock reader-writer lock protects the list of cached
+ * inodes. Since ip->ref indicates whether an entry is in use, and
+ * ip->dev and ip->inum indicate which i-node an entry holds, one must
+ * hold icache.lock while using any of those fields. In-memory inodes come
+ * from a slab cache and go back to it when their last reference is
+ * dropped, so the number of active i-nodes is only bounded by memory.
  *
  * An ip->lock sleep-lock protects all ip-> fields other than ref,
  * dev, and inum.  One must hold ip->lock in order to
  * read or write that inode's ip->valid, ip->size, ip->type, &c.
  */
 
+/*
+ * Lookups only take icache.lock for reading and bump ip->ref
+ * atomically, so they run in parallel on different cores. Linking,
+ * unlinking and plain ref updates happen with the lock held for
+ * writing.
+ */
 struct {
-  struct spinlock lock;
-  struct inode inode[NINODE];
+  struct rwlock lock;
+  struct inode *head;       /* Inodes with ref > 0 */
+  struct kmem_cache cache;
 } icache;
 
-void
-iinit(int dev)
+/* Slab constructor, runs once per inode object. */
+static void
+inode_ctor(void *obj)
 {
-    /* TODO: Your code here. */
-     int i = 0;
-
-    initlock(&icache.lock, "icache");
-    for (i = 0; i < NINODE; i++) {
-        initsleeplock(&icache.inode[i].lock, "inode");
-    }
+    struct inode *ip = obj;
+    initsleeplock(&ip->lock, "inode");
+}
 
-    readsb(dev, &sb);
-    //cprintf("sb: size %d nblocks %d ninodes %d nlog %d logstart %d inodestart %d bmap start %d\n", sb.size, sb.nblocks, sb.ninodes, sb.nlog, sb.logstart, sb.inodestart, sb.bmapstart);
+/* Set up the inode cache. Does no disk I/O, so it can run before the first process. */
+void
+iinit()
+{
+    initrwlock(&icache.lock, "icache");
+    initseqlock(&sbcache.lock, "superblock");
+    kmem_cache_init(&icache.cache, "inode", sizeof(struct inode), inode_ctor);
 }
 
 static struct inode* iget(uint32_t dev, uint32_t inum);
@@ -280,37 +317,41 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint32_t dev, uint32_t inum)
 {
-    /* TODO: Your code here. */
-    struct inode* ip, * empty;
-
-    acquire(&icache.lock);
+    struct inode* ip;
 
     // Is the inode already cached?
-    empty = 0;
+    read_acquire(&icache.lock);
+    for (ip = icache.head; ip; ip = ip->next) {
+        if (ip->dev == dev && ip->inum == inum) {
+            __atomic_add_fetch(&ip->ref, 1, __ATOMIC_RELAXED);
+            read_release(&icache.lock);
+            return ip;
+        }
+    }
+    read_release(&icache.lock);
 
-    for (ip = icache.inode; ip < icache.inode + NINODE; ip++) {
-        //get an active entry
-        if (ip->ref > 0 && ip->dev == dev && ip->inum == inum) {
+    // Not cached, look again in case someone added it meanwhile.
+    write_acquire(&icache.lock);
+    for (ip = icache.head; ip; ip = ip->next) {
+        if (ip->dev == dev && ip->inum == inum) {
             ip->ref++;
-            release(&icache.lock);
+            write_release(&icache.lock);
             return ip;
         }
-        if (empty == 0 && ip->ref == 0)    // Remember the first empty slot.
-            empty = ip;
     }
 
-    // Recycle an inode cache entry.
-    if (empty == 0)
+    if ((ip = kmem_cache_alloc(&icache.cache)) == 0)
         panic("iget: no inodes");
 
-    //get the first empty slot
-    empty->dev = dev;
-    empty->inum = inum;
-    empty->ref = 1;
-    empty->valid = 0;
+    ip->dev = dev;
+    ip->inum = inum;
+    ip->ref = 1;
+    ip->valid = 0;
+    ip->next = icache.head;
+    icache.head = ip;
 
-    release(&icache.lock);
-    return empty;
+    write_release(&icache.lock);
+    return ip;
 }
 
 /* 
@@ -321,9 +362,9 @@ struct inode*
 idup(struct inode *ip)
 {
     /* TODO: Your code here. */
-    acquire(&icache.lock);
-    ip->ref++;
-    release(&icache.lock);
+    read_acquire(&icache.lock);
+    __atomic_add_fetch(&ip->ref, 1, __ATOMIC_RELAXED);
+    read_release(&icache.lock);
     return ip;
 }
 
@@ -373,10 +414,8 @@ iunlock(struct inode *ip)
     if (ip == 0 || !holdingsleep(&ip->lock) || ip->ref < 1)
         panic("iunlock");
 
-    acquire(&icache.lock);
     releasesleep(&ip->lock);
     wakeup(ip);
-    release(&icache.lock);
 }
 
 /* Drop a reference to an in-memory inode.
@@ -392,28 +431,35 @@ void
 iput(struct inode *ip)
 {
     /* TODO: Your code here. */
-    acquire(&icache.lock);
+    write_acquire(&icache.lock);
 
     if (ip->ref == 1 && (ip->valid) && ip->nlink == 0) {
         // inode has no links: truncate and free inode.
         if (holdingsleep(&ip->lock)) {
             panic("iput busy");
         }
-        release(&icache.lock);
+        write_release(&icache.lock);
         acquiresleep(&ip->lock);
 
         itrunc(ip);
         ip->type = 0;
         iupdate(ip);
         releasesleep(&ip->lock);
-        acquire(&icache.lock);
+        write_acquire(&icache.lock);
         ip->valid = 0;
 
         wakeup(ip);
     }
 
-    ip->ref--;
-    release(&icache.lock);
+    if (--ip->ref == 0) {
+        // Last reference: drop it from the cache.
+        struct inode **pp;
+        for (pp = &icache.head; *pp != ip; pp = &(*pp)->next)
+            ;
+        *pp = ip->next;
+        kmem_cache_free(&icache.cache, ip);
+    }
+    write_release(&icache.lock);
 }
 
 /* Common idiom: unlock, then put. */
@@ -480,6 +526,7 @@ itrunc(struct inode *ip)
     struct buf* bp;
     uint32_t* a;
 
+    pcache_invalidate(ip);
     for (i = 0; i < NDIRECT; i++) {
         if (ip->addrs[i]) {
             bfree(ip->dev, ip->addrs[i]);
@@ -541,7 +588,8 @@ stati(struct inode *ip, struct stat *st)
 ssize_t
 readi(struct inode *ip, char *dst, size_t off, size_t n)
 {
-    size_t tot, m;
+    size_t tot, m, start = off;
+    char *base = dst;
     struct buf *bp;
 
     if (ip->type == T_DEV) {
@@ -561,6 +609,9 @@ readi(struct inode *ip, char *dst, size_t off, size_t n)
         memmove(dst, bp->data + off%BSIZE, m);
         brelse(bp);
     }
+    /* Pages of shared mappings may be newer than the disk. */
+    if (ip->type == T_FILE)
+        pcache_read(ip, base, start, n);
     return n;
 }
 
@@ -585,6 +636,7 @@ writei(struct inode *ip, char *src, size_t off, size_t n)
     if (off + n > MAXFILE*BSIZE)
         return -1;
 
+    pcache_write(ip, src, off, n);
     for (tot = 0; tot < n; tot += m, off += m, src += m) {
         bp = bread(ip->dev, bmap(ip, off/BSIZE));
         m = min(n - tot, BSIZE - off%BSIZE);
@@ -747,7 +799,7 @@ namex(char *path, int nameiparent, char *name)
     if (*path == '/')
         ip = iget(ROOTDEV, ROOTINO);
     else
-        ip = idup(thiscpu->proc->cwd);
+        ip = idup(thisproc()->cwd);
 
     while ((path = skipelem(path, name)) != 0) {
         ilock(ip);
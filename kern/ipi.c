@@ -0,0 +1,164 @@
+#include <stdint.h>
+
+#include "ipi.h"
+
+#include "types.h"
+#include "arm.h"
+#include "mmu.h"
+#include "peripherals/irq.h"
+#include "spinlock.h"
+#include "proc.h"
+
+/*
+ * Inter-processor interrupts.
+ *
+ * Each core of the BCM2836 local peripherals has four 32-bit
+ * mailboxes. Writing to another core's mailbox sets bits in it and
+ * raises an IRQ on that core until it clears them. We use IPI_MBOX,
+ * one bit per message, so messages of different kinds never get lost
+ * and repeated messages of one kind collapse into one interrupt.
+ *
+ * Function calls are queued per target CPU on a lock-free list, and
+ * IPI_CALL tells the target to run its queue.
+ */
+
+struct call {
+    void (*fn)(void *);
+    void *arg;
+    struct call *next;
+    volatile int done;
+};
+
+static struct call *call_queue[NCPU];
+
+/* Let mailbox IPIs interrupt this core. */
+void
+ipi_init()
+{
+    int cpu = cpuid();
+
+    put32(MBOX_RDCLR(cpu, IPI_MBOX), ~0U);
+    put32(MBOX_INT_CTRL(cpu), MBOX_INT_ENABLE(IPI_MBOX));
+}
+
+void
+ipi_send(int cpu, int msg)
+{
+    /* Make our memory writes visible before the target wakes up. */
+    asm volatile("dsb sy" : : : "memory");
+    put32(MBOX_SET(cpu, IPI_MBOX), msg);
+}
+
+/* Run the calls queued for this CPU. Interrupts are off. */
+static void
+call_run()
+{
+    struct call *c, *next;
+
+    c = __atomic_exchange_n(&call_queue[cpuid()], 0, __ATOMIC_ACQUIRE);
+    for (; c; c = next) {
+        /* The caller may reuse c as soon as it sees done. */
+        next = c->next;
+        c->fn(c->arg);
+        __atomic_store_n(&c->done, 1, __ATOMIC_RELEASE);
+    }
+}
+
+/* Called from interrupt() when this core's mailbox is not empty. */
+void
+ipi_intr()
+{
+    int cpu = cpuid();
+    uint32_t msg = get32(MBOX_RDCLR(cpu, IPI_MBOX));
+
+    put32(MBOX_RDCLR(cpu, IPI_MBOX), msg);
+
+    /* IPI_WAKEUP needs nothing: taking the interrupt ends wfi. */
+    if (msg & IPI_RESCHED)
+        thiscpu->need_resched = 1;
+    if (msg & IPI_CALL)
+        call_run();
+}
+
+/* Make cpu reschedule as soon as it next leaves a trap. */
+void
+smp_send_reschedule(int cpu)
+{
+    if (cpu == cpuid())
+        thiscpu->need_resched = 1;
+    else
+        ipi_send(cpu, IPI_RESCHED);
+}
+
+/*
+ * Run fn(arg) on every CPU in mask, this one included if it is in
+ * mask, and return once all of them are done. fn runs from the IPI
+ * handler with interrupts off, so it must be short and must not
+ * sleep. The caller must not hold a spinlock, which a target could
+ * be spinning on with interrupts off.
+ */
+void
+smp_call_function(uint64_t mask, void (*fn)(void *), void *arg)
+{
+    struct call calls[NCPU];
+    int self, pending;
+
+    push_off();
+    self = cpuid();
+    for (int i = 0; i < NCPU; i++) {
+        if (i == self || !(mask & CPU_BIT(i)))
+            continue;
+        struct call *c = &calls[i];
+        c->fn = fn;
+        c->arg = arg;
+        c->done = 0;
+        c->next = __atomic_load_n(&call_queue[i], __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&call_queue[i], &c->next, c, 0,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+        ipi_send(i, IPI_CALL);
+    }
+    if (mask & CPU_BIT(self))
+        fn(arg);
+
+    do {
+        /* Serve calls to us meanwhile, or two callers would deadlock. */
+        call_run();
+        pending = 0;
+        for (int i = 0; i < NCPU; i++)
+            if (i != self && (mask & CPU_BIT(i)) &&
+                !__atomic_load_n(&calls[i].done, __ATOMIC_ACQUIRE))
+                pending = 1;
+    } while (pending);
+    pop_off();
+}
+
+void
+smp_call_function_single(int cpu, void (*fn)(void *), void *arg)
+{
+    smp_call_function(CPU_BIT(cpu), fn, arg);
+}
+
+/* Ranges larger than this are flushed with one full invalidation. */
+#define TLB_FLUSH_MAX   64
+
+/*
+ * Drop the translations of [va, va + len) from the TLBs of all CPUs.
+ * Cortex-A53 broadcasts inner shareable TLB maintenance to the other
+ * cores in hardware, which is cheaper than interrupting each of them,
+ * so no IPI is needed; the final dsb waits until every core is done.
+ */
+void
+tlb_shootdown(uint64_t va, uint64_t len)
+{
+    uint64_t start = ROUNDDOWN(va, PGSIZE), end = ROUNDUP(va + len, PGSIZE);
+
+    asm volatile("dsb ishst" : : : "memory");
+    if ((end - start) / PGSIZE > TLB_FLUSH_MAX) {
+        asm volatile("tlbi vmalle1is");
+    } else {
+        for (uint64_t a = start; a < end; a += PGSIZE)
+            asm volatile("tlbi vaae1is, %[x]" : : [x]"r"((a >> 12) & 0xFFFFFFFFFFFULL));
+    }
+    asm volatile("dsb ish; isb" : : : "memory");
+}
@@ -0,0 +1,81 @@
+#include <stdint.h>
+#include "arm.h"
+#include "console.h"
+#include "proc.h"
+#include "ipi.h"
+
+/*
+ * Cross-call test, run by every CPU from main() when the kernel is
+ * built with TEST_IPI=1.
+ *
+ * All cores call all cores, themselves included, at the same time,
+ * so each one waits for the others while they wait for it. This only
+ * finishes if a waiting caller serves the calls queued for it. Then
+ * CPU 0 calls each other core on its own while they wait at a barrier
+ * with interrupts on, so the calls arrive by IPI. Every core counts
+ * the calls it ran per caller, and the counts must match.
+ */
+
+#define ITEST_ROUNDS    1000
+
+static int ran[NCPU][NCPU];     /* Calls run on [cpu] from [caller] */
+
+static struct {
+    volatile int arrived;
+    volatile int generation;
+} barrier;
+
+/*
+ * Wait until all NCPU cores have reached the barrier. Interrupts are
+ * on meanwhile, so calls to a core that is done still get served.
+ */
+static void
+cpu_barrier()
+{
+    int gen = barrier.generation;
+
+    sti();
+    if (__atomic_add_fetch(&barrier.arrived, 1, __ATOMIC_ACQ_REL) == NCPU) {
+        barrier.arrived = 0;
+        __atomic_store_n(&barrier.generation, gen + 1, __ATOMIC_RELEASE);
+    } else {
+        while (__atomic_load_n(&barrier.generation, __ATOMIC_ACQUIRE) == gen)
+            ;
+    }
+    cli();
+}
+
+static void
+count_call(void *caller)
+{
+    __atomic_fetch_add(&ran[cpuid()][(uint64_t)caller], 1, __ATOMIC_RELAXED);
+}
+
+void
+test_ipi()
+{
+    uint64_t self = cpuid(), all = (1ULL << NCPU) - 1;
+    int fail = 0;
+
+    cpu_barrier();
+    for (int i = 0; i < ITEST_ROUNDS; i++)
+        smp_call_function(all, count_call, (void *)self);
+    cpu_barrier();
+
+    if (self == 0)
+        for (int cpu = 1; cpu < NCPU; cpu++)
+            smp_call_function_single(cpu, count_call, (void *)self);
+    cpu_barrier();
+
+    for (int caller = 0; caller < NCPU; caller++) {
+        int want = ITEST_ROUNDS + (caller == 0 && self != 0);
+        if (ran[self][caller] != want) {
+            cprintf("test_ipi: [CPU%d] ran %d calls from CPU%d, want %d\n",
+                    (int)self, ran[self][caller], caller, want);
+            fail = 1;
+        }
+    }
+    if (!fail)
+        cprintf("test_ipi: [CPU%d] pass!\n", (int)self);
+    cpu_barrier();
+}
@@ -6,27 +6,291 @@
 #include "console.h"
 #include "kalloc.h"
 #include "spinlock.h"
+#include "arm.h"
+#include "proc.h"
 
 extern char end[];
 
-/* 
- * Free page's list element struct.
- * We store each free page's run structure in the free page itself.
+/*
+ * Physical memory from the end of the kernel up to PHYSTOP is
+ * managed by a binary buddy allocator. A free block of 2^order
+ * pages is always aligned to its own size, and its buddy is the
+ * block whose page frame number differs only in bit `order'.
+ * Freeing a block merges it with its buddy for as long as the buddy
+ * is free too, which keeps fragmentation bounded over long uptimes.
+ *
+ * Free block's list element struct.
+ * We store each free block's run structure in its first page.
  */
 struct run {
     struct run *next;
+    struct run *prev;
 };
 
+/*
+ * One descriptor per physical page frame. Descriptors live in the
+ * pages right after the kernel image and are never freed.
+ *
+ * ref counts the references to an allocated page beyond the first,
+ * so a page fresh from kalloc() has ref 0 and kfree() can ignore it.
+ * Only pages shared copy-on-write between address spaces ever have
+ * more than one reference, see page_get() and page_put().
+ */
+#define PG_BUDDY    0x1     /* First page of a free block of `order' */
+
+struct page {
+    uint32_t flags;
+    uint32_t order;
+    int32_t ref;
+};
+
+static struct page *pages;  /* Indexed by page frame number */
+static uint64_t npages;
+
 struct {
-    struct run *free_list; /* Free list of physical pages */
+    struct run free_area[MAX_ORDER]; /* Free lists of 2^order pages */
+    uint64_t nr_free[MAX_ORDER];
     struct spinlock lock;
+    int use_pcp;                     /* Route kalloc()/kfree() through kmem_cpu */
 } kmem;
 
+/*
+ * Per-CPU page magazines.
+ *
+ * Each CPU keeps a small private stack of free order-0 pages in
+ * front of the buddy allocator. kalloc() and kfree() only touch the
+ * magazine of the calling CPU, and go to the buddy lists in batches
+ * of PCP_BATCH pages when the magazine runs empty or grows past
+ * PCP_HIGH. Pages sitting in a magazine count as allocated as far
+ * as the buddy allocator is concerned.
+ *
+ * Next to the magazine every CPU keeps a pool of up to ZERO_HIGH
+ * pages that are already zeroed, refilled by kalloc_zero_refill()
+ * when the CPU has nothing better to do. kalloc() takes from that
+ * pool first and only clears a page itself when the pool is empty;
+ * kalloc_nozero() prefers the dirty magazine instead.
+ *
+ * No lock is needed. The magazines are only used between
+ * preempt_disable() and preempt_enable(), or by the scheduler with
+ * interrupts off, so a process cannot move to another CPU halfway.
+ * Neither kalloc() nor kfree() is called from interrupt handlers,
+ * so only the owning CPU ever touches its magazine. Each magazine
+ * sits in its own cache line to avoid false sharing.
+ */
+#define PCP_BATCH   32
+#define PCP_HIGH    (4 * PCP_BATCH)
+#define ZERO_HIGH   64
+
+struct kmem_cpu {
+    struct run *free_list;  /* Dirty pages */
+    int count;
+    struct run *zero_list;  /* Pages known to be all zero */
+    int nzero;
+} __attribute__((aligned(CACHELINE)));
+
+static struct kmem_cpu kmem_cpu[NCPU];
+
+static inline struct run *
+pfn2run(uint64_t pfn)
+{
+    return (struct run *)P2V(pfn << L3SHIFT);
+}
+
+static inline uint64_t
+run2pfn(void *r)
+{
+    return V2P(r) >> L3SHIFT;
+}
+
+static inline void
+area_push(int order, struct run *r)
+{
+    struct run *head = &kmem.free_area[order];
+    r->next = head->next;
+    r->prev = head;
+    head->next->prev = r;
+    head->next = r;
+    kmem.nr_free[order]++;
+}
+
+static inline void
+area_del(int order, struct run *r)
+{
+    r->prev->next = r->next;
+    r->next->prev = r->prev;
+    kmem.nr_free[order]--;
+}
+
+/* Put the block of 2^order pages at pfn back. Caller holds kmem.lock. */
+static void
+buddy_free(uint64_t pfn, int order)
+{
+    while (order < MAX_ORDER - 1) {
+        uint64_t buddy = pfn ^ (1UL << order);
+        if (buddy >= npages || !(pages[buddy].flags & PG_BUDDY) ||
+            pages[buddy].order != order)
+            break;
+        area_del(order, pfn2run(buddy));
+        pages[buddy].flags &= ~PG_BUDDY;
+        pfn &= ~(1UL << order);
+        order++;
+    }
+    pages[pfn].flags |= PG_BUDDY;
+    pages[pfn].order = order;
+    area_push(order, pfn2run(pfn));
+}
+
+/*
+ * Take a block of 2^order pages off the free lists, splitting a
+ * larger one if needed. Caller holds kmem.lock.
+ */
+static struct run *
+buddy_alloc(int order)
+{
+    struct run *r;
+    uint64_t pfn;
+    int o;
+
+    for (o = order; o < MAX_ORDER; o++)
+        if (kmem.nr_free[o])
+            break;
+    if (o == MAX_ORDER)
+        return 0;
+
+    r = kmem.free_area[o].next;
+    area_del(o, r);
+    pfn = run2pfn(r);
+    pages[pfn].flags &= ~PG_BUDDY;
+
+    /* Hand the upper halves back until the block is small enough. */
+    while (o > order) {
+        o--;
+        uint64_t half = pfn + (1UL << o);
+        pages[half].flags |= PG_BUDDY;
+        pages[half].order = o;
+        area_push(o, pfn2run(half));
+    }
+    return r;
+}
+
+/*
+ * Boot-time loading of the free lists is split into chunks of
+ * CHUNK_PAGES page frames, claimed by whichever CPU asks first in
+ * alloc_init_cpu(). Chunk boundaries are aligned to the largest
+ * block size, so no block ever straddles two chunks and CPUs only
+ * touch the page descriptors of their own chunks.
+ */
+#define NCHUNK      (4 * NCPU)
+#define CHUNK_ALIGN (1UL << (MAX_ORDER - 1))
+
+static uint64_t chunk_pages;
+static uint64_t first_pfn;      /* First page frame past the descriptors */
+static int next_chunk;
+
+/* Set up the global allocator state. Called once, before alloc_init_cpu(). */
 void
 alloc_init()
 {
     initlock(&kmem.lock, "kmem_lock");
-    free_range(end, P2V(PHYSTOP));
+    for (int i = 0; i < MAX_ORDER; i++)
+        kmem.free_area[i].next = kmem.free_area[i].prev = &kmem.free_area[i];
+
+    /* Page descriptors go right after the kernel image. */
+    npages = PHYSTOP >> L3SHIFT;
+    pages = (struct page *)ROUNDUP((char *)end, PGSIZE);
+    first_pfn = run2pfn(ROUNDUP((char *)(pages + npages), PGSIZE));
+    chunk_pages = ROUNDUP((npages + NCHUNK - 1) / NCHUNK, CHUNK_ALIGN);
+    kmem.use_pcp = 1;
+}
+
+/*
+ * Hand free physical memory to the allocator. Every CPU calls this
+ * once after alloc_init() and keeps claiming chunks until none are
+ * left, so boot is not held up by a core that comes up late.
+ */
+void
+alloc_init_cpu()
+{
+    int i;
+
+    while ((i = __atomic_fetch_add(&next_chunk, 1, __ATOMIC_RELAXED)) < NCHUNK) {
+        uint64_t lo = i * chunk_pages;
+        uint64_t hi = MIN(lo + chunk_pages, npages);
+        if (lo >= hi)
+            continue;
+
+        memset(pages + lo, 0, (hi - lo) * sizeof(struct page));
+        lo = MAX(lo, first_pfn);
+        if (lo < hi)
+            free_range(pfn2run(lo), pfn2run(hi));
+    }
+}
+
+/* Enable or disable the per-CPU magazines, returns the old setting. */
+int
+kalloc_set_pcp(int on)
+{
+    int old = kmem.use_pcp;
+    kmem.use_pcp = on;
+    return old;
+}
+
+/* Move up to n order-0 pages from the buddy allocator into pcp. */
+static void
+pcp_refill(struct kmem_cpu *pcp, int n)
+{
+    struct run *r;
+
+    acquire(&kmem.lock);
+    while (n-- > 0 && (r = buddy_alloc(0))) {
+        r->next = pcp->free_list;
+        pcp->free_list = r;
+        pcp->count++;
+    }
+    release(&kmem.lock);
+}
+
+/* Give n pages of pcp back to the buddy allocator. */
+static void
+pcp_drain(struct kmem_cpu *pcp, int n)
+{
+    struct run *r;
+
+    acquire(&kmem.lock);
+    while (n-- > 0 && (r = pcp->free_list)) {
+        pcp->free_list = r->next;
+        pcp->count--;
+        buddy_free(run2pfn(r), 0);
+    }
+    release(&kmem.lock);
+}
+
+static void
+check_block(char *v, int order)
+{
+    if (order < 0 || order >= MAX_ORDER ||
+        (uint64_t)V2P(v) % ((uint64_t)PGSIZE << order) ||
+        v < (char *)(pages + npages) || V2P(v) >= PHYSTOP)
+        panic("kfree\n");
+}
+
+/*
+ * Free the block of 2^order physically contiguous pages pointed
+ * at by v, which must have come from kalloc_pages(order).
+ */
+void
+kfree_pages(char *v, int order)
+{
+    check_block(v, order);
+
+#ifdef DEBUG_KALLOC
+    /* Fill with junk to catch dangling refs. */
+    memset(v, 1, (uint64_t)PGSIZE << order);
+#endif
+
+    acquire(&kmem.lock);
+    buddy_free(run2pfn(v), order);
+    release(&kmem.lock);
 }
 
 /* Free the page of physical memory pointed at by v. */
@@ -35,30 +299,139 @@ kfree(char *v)
 {
     struct run *r;
 
-    if ((uint64_t)v % PGSIZE || v < end || V2P(v) >= PHYSTOP)
-        panic("kfree\n");
+    if (!kmem.use_pcp) {
+        kfree_pages(v, 0);
+        return;
+    }
 
+    check_block(v, 0);
+
+#ifdef DEBUG_KALLOC
     /* Fill with junk to catch dangling refs. */
     memset(v, 1, PGSIZE);
-    
-    /* TODO: Your code here. */
+#endif
+
+    preempt_disable();
+    struct kmem_cpu *pcp = &kmem_cpu[cpuid()];
     r = (struct run*)v;
-    acquire(&kmem.lock);
-    r->next = kmem.free_list;
-    kmem.free_list = r;
-    release(&kmem.lock);
+    r->next = pcp->free_list;
+    pcp->free_list = r;
+    if (++pcp->count > PCP_HIGH)
+        pcp_drain(pcp, PCP_BATCH);
+    preempt_enable();
+}
+
+/* Take another reference to the page at v. */
+void
+page_get(char *v)
+{
+    check_block(v, 0);
+    __atomic_fetch_add(&pages[run2pfn(v)].ref, 1, __ATOMIC_RELAXED);
+}
+
+/* Drop a reference to the page at v, and free it with the last one. */
+void
+page_put(char *v)
+{
+    struct page *pg;
+
+    check_block(v, 0);
+    pg = &pages[run2pfn(v)];
+    if (__atomic_fetch_sub(&pg->ref, 1, __ATOMIC_ACQ_REL) == 0) {
+        pg->ref = 0;
+        kfree(v);
+    }
 }
 
+/* Does anybody besides the caller hold a reference to the page at v? */
+int
+page_shared(char *v)
+{
+    return __atomic_load_n(&pages[run2pfn(v)].ref, __ATOMIC_ACQUIRE) > 0;
+}
+
+/*
+ * Free every whole page in [vstart, vend). The range is cut into the
+ * largest aligned blocks that fit and handed to the buddy lists under
+ * a single acquisition of kmem.lock, skipping the per-page work of
+ * kfree().
+ */
 void
 free_range(void *vstart, void *vend)
 {
-    char *p;
-    p = ROUNDUP((char *)vstart, PGSIZE);
-    for (; p + PGSIZE <= (char *)vend; p += PGSIZE)
-        kfree(p);
+    uint64_t lo = run2pfn(ROUNDUP((char *)vstart, PGSIZE));
+    uint64_t hi = run2pfn(ROUNDDOWN((char *)vend, PGSIZE));
+
+    acquire(&kmem.lock);
+    while (lo < hi) {
+        int order = 0;
+        while (order < MAX_ORDER - 1 && !(lo & (1UL << order)) &&
+               lo + (2UL << order) <= hi)
+            order++;
+        buddy_free(lo, order);
+        lo += 1UL << order;
+    }
+    release(&kmem.lock);
 }
 
-/* 
+static struct run *
+buddy_get(int order)
+{
+    struct run *r;
+
+    if (order < 0 || order >= MAX_ORDER)
+        return 0;
+
+    acquire(&kmem.lock);
+    r = buddy_alloc(order);
+    release(&kmem.lock);
+    return r;
+}
+
+/*
+ * Allocate 2^order physically contiguous pages, aligned to their
+ * total size. Returns a pointer that the kernel can use.
+ * Returns 0 if the memory cannot be allocated.
+ */
+char *
+kalloc_pages(int order)
+{
+    struct run *r = buddy_get(order);
+
+    if (r) {
+        memset((char*)r, 0, (uint64_t)PGSIZE << order);
+    }
+    return (char*)r;
+}
+
+/*
+ * Allocate one page whose contents are undefined, for callers
+ * that overwrite the whole page anyway.
+ */
+char *
+kalloc_nozero()
+{
+    struct run *r;
+
+    if (!kmem.use_pcp)
+        return (char *)buddy_get(0);
+
+    preempt_disable();
+    struct kmem_cpu *pcp = &kmem_cpu[cpuid()];
+    if (!pcp->free_list && !pcp->zero_list)
+        pcp_refill(pcp, PCP_BATCH);
+    if ((r = pcp->free_list)) {
+        pcp->free_list = r->next;
+        pcp->count--;
+    } else if ((r = pcp->zero_list)) {
+        pcp->zero_list = r->next;
+        pcp->nzero--;
+    }
+    preempt_enable();
+    return (char *)r;
+}
+
+/*
  * Allocate one 4096-byte page of physical memory.
  * Returns a pointer that the kernel can use.
  * Returns 0 if the memory cannot be allocated.
@@ -66,32 +439,91 @@ free_range(void *vstart, void *vend)
 char *
 kalloc()
 {
-    /* TODO: Your code here. */
     struct run* r;
 
-    acquire(&kmem.lock);
-    r = kmem.free_list;
+    if (!kmem.use_pcp)
+        return kalloc_pages(0);
+
+    preempt_disable();
+    struct kmem_cpu *pcp = &kmem_cpu[cpuid()];
+    if ((r = pcp->zero_list)) {
+        pcp->zero_list = r->next;
+        pcp->nzero--;
+    }
+    preempt_enable();
     if (r) {
-        kmem.free_list = r->next;
+        r->next = 0;
+        return (char *)r;
     }
-    release(&kmem.lock);
 
     // clear memory before return
-    if (r) {
+    if ((r = (struct run *)kalloc_nozero())) {
         memset((char*)r, 0, PGSIZE);
     }
 
     return (char*)r;
 }
 
+/*
+ * Top up this CPU's pool of zeroed pages. Called by a CPU that has
+ * nothing to run, so that later kalloc() calls can skip the memset.
+ */
+void
+kalloc_zero_refill()
+{
+    struct run *r;
+
+    if (!kmem.use_pcp)
+        return;
+
+    /* Only called by the scheduler, which runs with interrupts off. */
+    struct kmem_cpu *pcp = &kmem_cpu[cpuid()];
+    while (pcp->nzero < ZERO_HIGH) {
+        if (!pcp->free_list)
+            pcp_refill(pcp, PCP_BATCH);
+        if (!(r = pcp->free_list))
+            break;
+        pcp->free_list = r->next;
+        pcp->count--;
+
+        memset((char*)r, 0, PGSIZE);
+        r->next = pcp->zero_list;
+        pcp->zero_list = r;
+        pcp->nzero++;
+    }
+}
+
 void
 check_free_list()
 {
     struct run *p;
-    if (!kmem.free_list)
-        panic("kmem.free_list is a null pointer!\n");
+    uint64_t nfree = 0;
+
+    acquire(&kmem.lock);
+    for (int o = 0; o < MAX_ORDER; o++) {
+        uint64_t n = 0;
+        for (p = kmem.free_area[o].next; p != &kmem.free_area[o]; p = p->next, n++) {
+            uint64_t pfn = run2pfn(p);
+            assert((void *)p > (void *)end);
+            assert(pfn % (1UL << o) == 0);
+            assert((pages[pfn].flags & PG_BUDDY) && pages[pfn].order == o);
+        }
+        assert(n == kmem.nr_free[o]);
+        nfree += n << o;
+    }
+    release(&kmem.lock);
+    if (!nfree)
+        panic("check_free_list: no free memory!\n");
+
+    for (int i = 0; i < NCPU; i++) {
+        int n = 0;
+        for (p = kmem_cpu[i].free_list; p; p = p->next, n++)
+            assert((void *)p > (void *)end);
+        assert(n == kmem_cpu[i].count);
 
-    for (p = kmem.free_list; p; p = p->next) {
-        assert((void *)p > (void *)end);
+        n = 0;
+        for (p = kmem_cpu[i].zero_list; p; p = p->next, n++)
+            assert((void *)p > (void *)end);
+        assert(n == kmem_cpu[i].nzero);
     }
 }
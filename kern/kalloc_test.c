@@ -0,0 +1,89 @@
+#include <stdint.h>
+#include "arm.h"
+#include "mmu.h"
+#include "memlayout.h"
+#include "console.h"
+#include "kalloc.h"
+#include "proc.h"
+
+/*
+ * Allocator stress test, run by every CPU from main() when the
+ * kernel is built with TEST_KALLOC=1.
+ *
+ * All cores hammer kalloc()/kfree() at the same time, the way a fork
+ * storm does, first through the global free list only and then with
+ * the per-CPU magazines enabled, and report allocations per second.
+ */
+
+#define KTEST_ROUNDS    2000
+#define KTEST_BATCH     16      /* Pages held at once, like a small fork */
+
+static struct {
+    volatile int arrived;
+    volatile int generation;
+} barrier;
+
+/* Wait until all NCPU cores have reached the barrier. */
+static void
+cpu_barrier()
+{
+    int gen = barrier.generation;
+    if (__atomic_add_fetch(&barrier.arrived, 1, __ATOMIC_ACQ_REL) == NCPU) {
+        barrier.arrived = 0;
+        __atomic_store_n(&barrier.generation, gen + 1, __ATOMIC_RELEASE);
+    } else {
+        while (__atomic_load_n(&barrier.generation, __ATOMIC_ACQUIRE) == gen)
+            ;
+    }
+}
+
+static void
+kalloc_round(const char *name)
+{
+    char *pages[KTEST_BATCH];
+    uint64_t t0, t1, n = (uint64_t)KTEST_ROUNDS * KTEST_BATCH;
+
+    cpu_barrier();
+    t0 = timestamp();
+    for (int i = 0; i < KTEST_ROUNDS; i++) {
+        for (int j = 0; j < KTEST_BATCH; j++)
+            if ((pages[j] = kalloc()) == 0)
+                panic("test_kalloc: out of memory\n");
+        for (int j = 0; j < KTEST_BATCH; j++)
+            kfree(pages[j]);
+    }
+    t1 = timestamp();
+    cpu_barrier();
+
+    uint64_t rate = n * timerfreq() / (t1 - t0 ? t1 - t0 : 1);
+    cprintf("test_kalloc: [CPU%d] %s: %lld allocs/s\n", cpuid(), name, rate);
+}
+
+void
+test_kalloc()
+{
+    int old = 1;
+
+    cpu_barrier();
+    if (cpuid() == 0)
+        old = kalloc_set_pcp(0);
+    kalloc_round("global list");
+
+    if (cpuid() == 0)
+        kalloc_set_pcp(1);
+    kalloc_round("per-cpu cache");
+
+    if (cpuid() == 0) {
+        kalloc_set_pcp(old);
+
+        /* Contiguous blocks must be aligned to their size. */
+        for (int order = 0; order < MAX_ORDER; order++) {
+            char *p = kalloc_pages(order);
+            assert(p && V2P(p) % ((uint64_t)PGSIZE << order) == 0);
+            kfree_pages(p, order);
+        }
+        check_free_list();
+        cprintf("test_kalloc pass!\n");
+    }
+    cpu_barrier();
+}
@@ -5,6 +5,7 @@
 #include "fs.h"
 #include "buf.h"
 #include "string.h"
+#include "proc.h"
 
 /* Simple logging that allows concurrent FS system calls.
  *
@@ -100,6 +101,7 @@ install_trans()
         bwrite(dbuf); //write dst to disk
         brelse(lbuf);
         brelse(dbuf);
+        cond_resched();
     }
 }
 
@@ -228,6 +230,7 @@ write_log()
         bwrite(to);  // write the log
         brelse(from);
         brelse(to);
+        cond_resched();
     }
 }
 
@@ -6,12 +6,16 @@
 #include "kalloc.h"
 #include "trap.h"
 #include "timer.h"
+#include "ipi.h"
 #include "spinlock.h"
 #include "proc.h"
 #include "sd.h"
 #include "log.h"
+#include "file.h"
+#include "pcache.h"
 
-struct cpu cpus[NCPU];
+/* In .data so that clearing .bss keeps the push_off() depth of every CPU. */
+struct cpu cpus[NCPU] __attribute__((section(".data")));
 
 struct do_once
 {
@@ -20,9 +24,21 @@ struct do_once
 };
 
 struct do_once alloc_once = { 0 };
-struct do_once bss_clear = { 0 };
+/*
+ * Lives in .data: the memset below clears .bss while this lock is
+ * held, and a ticket lock must not have its counters reset under
+ * the CPUs queued on it.
+ */
+struct do_once bss_clear __attribute__((section(".data"))) = { 0 };
 struct do_once initproc_once = { 0 };
 
+/* Microseconds on the system counter since t0. */
+static uint64_t
+usecs_since(uint64_t t0)
+{
+    return (timestamp() - t0) * 1000000 / timerfreq();
+}
+
 void
 main()
 {
@@ -33,6 +49,7 @@ main()
      */
 
     extern char edata[], end[], vectors[];
+    uint64_t t0 = timestamp(), t;
 
     /*
      * Determine which functions in main can only be
@@ -51,14 +68,20 @@ main()
     console_init();
     cprintf("main: [CPU%d] is init kernel\n", cpuid());
 
+    t = timestamp();
     acquire(&alloc_once.lock);
     if (!alloc_once.count) {
         alloc_once.count = 1;
         alloc_init();
-        // check_free_list();
         cprintf("Allocator: Init success.\n");
     }
     release(&alloc_once.lock);
+    alloc_init_cpu();
+    cprintf("main: [CPU%d] free memory loaded in %lld us\n", cpuid(), usecs_since(t));
+
+#ifdef TEST_KALLOC
+    test_kalloc();
+#endif
 
     irq_init();
 
@@ -66,15 +89,14 @@ main()
     if (!initproc_once.count) {
         initproc_once.count = 1;
         proc_init();
+        vclock_init();
+        iinit();
         user_init();
-        user_idle_init();
-        user_idle_init();
-        user_idle_init();
-        user_idle_init();
 
         sd_init();
         binit();
         fileinit();
+        pcache_init();
 
         cprintf("init the proc successfully\n");
     }
@@ -82,8 +104,13 @@ main()
 
     lvbar(vectors);
     timer_init();
+    ipi_init();
+
+#ifdef TEST_IPI
+    test_ipi();
+#endif
 
-    cprintf("main: [CPU%d] Init success.\n", cpuid());
+    cprintf("main: [CPU%d] Init success in %lld us.\n", cpuid(), usecs_since(t0));
     scheduler();
     while (1) ;
 }
@@ -0,0 +1,279 @@
+/*
+ * Page cache.
+ *
+ * Whole pages of file data, keyed by inode and page-aligned file
+ * offset, so that every process running a program maps the same
+ * physical pages of its text instead of reading its own copy.
+ *
+ * The cache holds the first reference to each of its pages and hands
+ * out more with page_get(). A page is only evicted when nobody else
+ * holds a reference, which pcache.lock makes safe: new references
+ * are only taken under it.
+ *
+ * Shared file mappings map the cached pages themselves and write to
+ * them, so such pages are marked shared and kept coherent with the
+ * file: writei() copies new data into them as well as to disk, and
+ * readi() reads them in preference to the disk, since mapped pages
+ * are only written back when they are unmapped. Other cached pages
+ * may be mapped as text or copy-on-write, which must not change under
+ * their mappers, so writei() drops them from the cache instead; their
+ * mappers keep the old data and later faults read the new. Truncating
+ * a file drops all its pages.
+ */
+
+#include <stdint.h>
+
+#include "types.h"
+#include "mmu.h"
+#include "string.h"
+#include "console.h"
+#include "spinlock.h"
+#include "kalloc.h"
+#include "file.h"
+#include "pcache.h"
+
+#define NPCACHE     256     /* Cached pages */
+#define NPHASH      64      /* Hash chains, one per group of inodes */
+
+struct pcpage {
+    uint32_t dev;
+    uint32_t inum;
+    uint64_t off;
+    char *page;             /* 0 if the entry is free */
+    int shared;             /* Mapped by a shared file mapping */
+    struct pcpage *next;    /* Hash chain */
+    struct pcpage **pprev;
+};
+
+struct {
+    struct spinlock lock;
+    struct pcpage ent[NPCACHE];
+    struct pcpage *hash[NPHASH];
+    int nshared[NPHASH];    /* Shared pages on each chain */
+    int hand;               /* Clock hand for eviction */
+    uint64_t nhit, nmiss;
+} pcache;
+
+/* All pages of an inode share one chain, so invalidation walks only it. */
+static inline int
+hashno(uint32_t dev, uint32_t inum)
+{
+    return (dev * 31 + inum) % NPHASH;
+}
+
+static inline struct pcpage **
+chain(uint32_t dev, uint32_t inum)
+{
+    return &pcache.hash[hashno(dev, inum)];
+}
+
+void
+pcache_init()
+{
+    initlock(&pcache.lock, "pcache");
+}
+
+static struct pcpage *
+lookup(uint32_t dev, uint32_t inum, uint64_t off)
+{
+    for (struct pcpage *e = *chain(dev, inum); e; e = e->next)
+        if (e->dev == dev && e->inum == inum && e->off == off)
+            return e;
+    return 0;
+}
+
+static void
+mark_shared(struct pcpage *e)
+{
+    if (!e->shared) {
+        e->shared = 1;
+        pcache.nshared[hashno(e->dev, e->inum)]++;
+    }
+}
+
+static void
+evict(struct pcpage *e)
+{
+    if (e->shared) {
+        e->shared = 0;
+        pcache.nshared[hashno(e->dev, e->inum)]--;
+    }
+    *e->pprev = e->next;
+    if (e->next)
+        e->next->pprev = e->pprev;
+    page_put(e->page);
+    e->page = 0;
+}
+
+/* Find a free entry, evicting a page nobody maps if need be. */
+static struct pcpage *
+victim()
+{
+    for (int i = 0; i < NPCACHE; i++) {
+        struct pcpage *e = &pcache.ent[pcache.hand];
+        pcache.hand = (pcache.hand + 1) % NPCACHE;
+        if (!e->page)
+            return e;
+        if (!page_shared(e->page)) {
+            evict(e);
+            return e;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Get the page of ip's data at page-aligned offset off, zero past the
+ * end of the file. Returns it with a reference for the caller to
+ * page_put(), or 0 if it cannot be read. If shared, the caller maps
+ * it into a shared file mapping. May sleep; the caller must not hold
+ * ip's lock. Writers hold it while they update the cache.
+ */
+char *
+pcache_get(struct inode *ip, uint64_t off, int shared)
+{
+    struct pcpage *e, **head;
+    char *pg;
+
+    acquire(&pcache.lock);
+    if ((e = lookup(ip->dev, ip->inum, off))) {
+        page_get(e->page);
+        if (shared)
+            mark_shared(e);
+        pcache.nhit++;
+        release(&pcache.lock);
+        return e->page;
+    }
+    pcache.nmiss++;
+    release(&pcache.lock);
+
+    if ((pg = kalloc()) == 0)
+        return 0;
+    ilock(ip);
+    if (off >= ip->size || readi(ip, pg, off, MIN(PGSIZE, ip->size - off)) < 0) {
+        iunlock(ip);
+        kfree(pg);
+        return 0;
+    }
+
+    /* Insert before iunlock(), so a writer cannot slip in between. */
+    acquire(&pcache.lock);
+    if ((e = lookup(ip->dev, ip->inum, off))) {
+        /* Somebody else read it meanwhile. */
+        kfree(pg);
+        pg = e->page;
+        page_get(pg);
+        if (shared)
+            mark_shared(e);
+    } else if ((e = victim())) {
+        e->dev = ip->dev;
+        e->inum = ip->inum;
+        e->off = off;
+        e->page = pg;
+        if (shared)
+            mark_shared(e);
+        head = chain(ip->dev, ip->inum);
+        e->next = *head;
+        if (*head)
+            (*head)->pprev = &e->next;
+        e->pprev = head;
+        *head = e;
+        page_get(pg);
+    }
+    /*
+     * Otherwise every cached page is in use; the caller gets its own,
+     * which a shared mapping then does not share with anybody.
+     */
+    release(&pcache.lock);
+    iunlock(ip);
+    return pg;
+}
+
+/*
+ * Copy between buf and the shared cached pages of ip that
+ * [off, off + n) of the file falls on: into the pages if write, else
+ * out of them. If write, the other cached pages there are evicted.
+ * The caller holds ip's lock, so no page of ip is added meanwhile.
+ */
+static void
+pcache_copy(struct inode *ip, char *buf, uint64_t off, uint64_t n, int write)
+{
+    struct pcpage *e;
+    uint64_t a, lo, hi;
+    char *pg, *p;
+
+    for (a = ROUNDDOWN(off, PGSIZE); a < off + n; a += PGSIZE) {
+        acquire(&pcache.lock);
+        if ((e = lookup(ip->dev, ip->inum, a)) == 0 || !e->shared) {
+            if (e && write)
+                evict(e);
+            release(&pcache.lock);
+            continue;
+        }
+        pg = e->page;
+        page_get(pg);
+        release(&pcache.lock);
+
+        lo = MAX(off, a);
+        hi = MIN(off + n, a + PGSIZE);
+        p = pg + (lo - a);
+        /* Writing back a mapped page copies it onto itself. */
+        if (p != buf + (lo - off)) {
+            if (write)
+                memmove(p, buf + (lo - off), hi - lo);
+            else
+                memmove(buf + (lo - off), p, hi - lo);
+        }
+        page_put(pg);
+    }
+}
+
+/*
+ * Bring the cache up to date with n bytes at src, written to ip at
+ * off: update its shared pages and drop the others.
+ */
+void
+pcache_write(struct inode *ip, char *src, uint64_t off, uint64_t n)
+{
+    pcache_copy(ip, src, off, n, 1);
+}
+
+/*
+ * Read the shared pages cached for [off, off + n) of ip over dst.
+ * Reads of files nobody maps shared skip the lock; a shared mapping
+ * that appears meanwhile has not written anything yet.
+ */
+void
+pcache_read(struct inode *ip, char *dst, uint64_t off, uint64_t n)
+{
+    if (__atomic_load_n(&pcache.nshared[hashno(ip->dev, ip->inum)], __ATOMIC_RELAXED) == 0)
+        return;
+    pcache_copy(ip, dst, off, n, 0);
+}
+
+/* Drop the cached pages of ip, whose data is being discarded. */
+void
+pcache_invalidate(struct inode *ip)
+{
+    struct pcpage *e, *next;
+
+    acquire(&pcache.lock);
+    for (e = *chain(ip->dev, ip->inum); e; e = next) {
+        next = e->next;
+        if (e->dev == ip->dev && e->inum == ip->inum)
+            evict(e);
+    }
+    release(&pcache.lock);
+}
+
+void
+pcache_dump()
+{
+    int n = 0;
+
+    acquire(&pcache.lock);
+    for (int i = 0; i < NPCACHE; i++)
+        n += pcache.ent[i].page != 0;
+    cprintf("pcache: %d pages, %lld hits, %lld misses\n", n, pcache.nhit, pcache.nmiss);
+    release(&pcache.lock);
+}
@@ -1,3 +1,6 @@
+#include <sched.h>
+
+#include "types.h"
 #include "proc.h"
 #include "spinlock.h"
 #include "console.h"
@@ -9,7 +12,10 @@
 #include "sd.h"
 #include "file.h"
 #include "log.h"
+#include "timer.h"
+#include "ipi.h"
 
+/* ptable.lock serializes handing out UNUSED slots. */
 struct {
     struct proc proc[NPROC];
     struct spinlock lock;
@@ -17,6 +23,470 @@ struct {
 
 static struct proc *initproc;
 
+/*
+ * Protects p->parent, so that wait() and exit() see a consistent
+ * view of the process tree, and lets wait() sleep without holding
+ * p->lock. Taken before any wait queue lock and p->lock.
+ */
+static struct spinlock wait_lock;
+
+/*
+ * Wait queues.
+ *
+ * Sleeping processes are linked through p->wq_next into one of
+ * NWAITQ buckets picked by hashing the channel, each with its own
+ * lock. wakeup(chan) only walks the sleepers of its bucket and never
+ * touches ptable.lock. The lock order is: the caller's condition
+ * lock, then the bucket lock, then p->lock.
+ */
+#define WAITQ_SHIFT 6
+#define NWAITQ      (1 << WAITQ_SHIFT)
+
+struct waitq {
+    struct spinlock lock;
+    struct proc *head;
+} __attribute__((aligned(CACHELINE)));
+
+static struct waitq waitq[NWAITQ];
+
+static inline struct waitq *
+waitq_of(void *chan)
+{
+    return &waitq[((uint64_t)chan * 0x9E3779B97F4A7C15UL) >> (64 - WAITQ_SHIFT)];
+}
+
+/*
+ * Run queues.
+ *
+ * Every CPU has its own run queue with its own lock, so picking the
+ * next process is O(1) and CPUs do not contend unless one of them
+ * runs dry and steals from the busiest queue. Lock order: p->lock,
+ * then a run queue lock.
+ *
+ * A process only runs on the CPUs in p->cpumask. Within those, it
+ * goes back to the queue of the CPU it last ran on, whose caches and
+ * TLB are likely still warm, unless that queue is clearly longer
+ * than another allowed one. Stealing likewise leaves processes that
+ * stopped running less than CACHE_HOT_US ago where they are, if it
+ * can.
+ *
+ * Real-time processes (SCHED_FIFO and SCHED_RR) have a FIFO per
+ * priority, found through a bitmap, and always run before normal
+ * ones. Queueing one that outranks what a CPU is running sends that
+ * CPU a reschedule IPI, and it switches as soon as it leaves the
+ * interrupt.
+ *
+ * A CPU with nothing to run sleeps in idle() and sets its bit in
+ * idle_mask. runq_push() wakes it with an IPI when it queues work
+ * there, or when it queues work on a busy CPU that the idle one may
+ * steal.
+ *
+ * Normal processes are in a multi-level feedback queue with NQUEUE
+ * FIFOs, level 0 first. A process that uses up the MLFQ_QUANTUM() of
+ * its level drops one level, and one that wakes up from sleep()
+ * climbs one, so CPU-bound jobs sink below interactive ones. Every
+ * MLFQ_BOOST_MS all processes go back to their top level, which is
+ * 0 unless lowered by a positive nice value. A negative nice value
+ * instead raises the bottom level a process can sink to, up to level
+ * 0 near -NZERO, so it keeps the CPU ahead of CPU-bound jobs of nice
+ * 0 however long it runs. Rather than walking all
+ * processes, the boost is applied lazily: each run queue and process
+ * remembers the boost epoch it last saw.
+ */
+#define NQUEUE          4
+#define MLFQ_QUANTUM(l) (1 << (l))  /* Timer ticks */
+#define MLFQ_BOOST_MS   10000
+#define RR_QUANTUM      10          /* Timer ticks, for SCHED_RR */
+#define CACHE_HOT_US    500
+
+struct rqlist {
+    struct proc *head;
+    struct proc *tail;
+};
+
+struct runq {
+    struct spinlock lock;
+    struct rqlist rt[NRTPRIO];  /* Real-time FIFOs by priority */
+    uint64_t rtmap[2];          /* Non-empty rt[] lists */
+    struct rqlist mlfq[NQUEUE];
+    int nr;                     /* Queued processes, all lists */
+    uint64_t epoch;             /* Boost epoch of the MLFQ levels */
+} __attribute__((aligned(CACHELINE)));
+
+static struct runq runq[NCPU];
+static uint64_t idle_mask;      /* CPUs sleeping in idle() */
+
+static uint64_t
+boost_epoch()
+{
+    return timestamp() / (timerfreq() / 1000 * MLFQ_BOOST_MS);
+}
+
+/* Highest level p may run at. */
+static inline int
+prio_top(struct proc *p)
+{
+    return MAX(p->nice, 0) * NQUEUE / (NZERO);
+}
+
+/* Lowest level p may sink to. */
+static inline int
+prio_bottom(struct proc *p)
+{
+    return MAX(NQUEUE - 1 + MIN(p->nice, 0) * NQUEUE / (NZERO), 0);
+}
+
+/* Apply a boost that p has not seen yet. */
+static void
+boost_check(struct proc *p, uint64_t epoch)
+{
+    if (p->epoch != epoch) {
+        p->epoch = epoch;
+        p->prio = prio_top(p);
+        p->slice = 0;
+    }
+}
+
+/* Scheduling rank: real-time priority, 0 for normal processes. */
+static inline int
+rank(struct proc *p)
+{
+    return p->policy == SCHED_OTHER ? 0 : p->rtprio;
+}
+
+/* Highest queued real-time priority, or 0. Racy unless rq->lock is held. */
+static int
+runq_rtprio(struct runq *rq)
+{
+    uint64_t hi = __atomic_load_n(&rq->rtmap[1], __ATOMIC_RELAXED);
+    uint64_t lo = __atomic_load_n(&rq->rtmap[0], __ATOMIC_RELAXED);
+
+    if (hi)
+        return 127 - __builtin_clzll(hi);
+    if (lo)
+        return 63 - __builtin_clzll(lo);
+    return 0;
+}
+
+static void
+rqlist_append(struct rqlist *l, struct proc *p)
+{
+    p->rq_next = 0;
+    if (l->tail)
+        l->tail->rq_next = p;
+    else
+        l->head = p;
+    l->tail = p;
+}
+
+/* Unlink p, which follows prev on l. */
+static void
+rqlist_remove(struct rqlist *l, struct proc *prev, struct proc *p)
+{
+    if (prev)
+        prev->rq_next = p->rq_next;
+    else
+        l->head = p->rq_next;
+    if (l->tail == p)
+        l->tail = prev;
+}
+
+/* The list p belongs on. */
+static struct rqlist *
+runq_list(struct runq *rq, struct proc *p)
+{
+    return p->policy == SCHED_OTHER ? &rq->mlfq[p->prio] : &rq->rt[p->rtprio];
+}
+
+/* Caller holds rq->lock. */
+static void
+runq_enqueue(struct runq *rq, struct proc *p)
+{
+    if (p->policy != SCHED_OTHER)
+        rq->rtmap[p->rtprio / 64] |= 1ULL << (p->rtprio % 64);
+    rqlist_append(runq_list(rq, p), p);
+    rq->nr++;
+}
+
+/* Unlink p, which follows prev on list l. Caller holds rq->lock. */
+static void
+runq_remove(struct runq *rq, struct rqlist *l, struct proc *prev, struct proc *p)
+{
+    rqlist_remove(l, prev, p);
+    if (l >= rq->rt && l < rq->rt + NRTPRIO && !l->head) {
+        int prio = l - rq->rt;
+        rq->rtmap[prio / 64] &= ~(1ULL << (prio % 64));
+    }
+    rq->nr--;
+}
+
+/* Caller holds rq->lock. */
+static struct proc *
+runq_dequeue_mlfq(struct runq *rq)
+{
+    struct proc *p;
+
+    for (int l = 0; l < NQUEUE; l++) {
+        if ((p = rq->mlfq[l].head) != 0) {
+            runq_remove(rq, &rq->mlfq[l], 0, p);
+            return p;
+        }
+    }
+    return 0;
+}
+
+/* Caller holds rq->lock. */
+static struct proc *
+runq_dequeue(struct runq *rq)
+{
+    int prio = runq_rtprio(rq);
+    struct proc *p;
+
+    if (prio) {
+        p = rq->rt[prio].head;
+        runq_remove(rq, &rq->rt[prio], 0, p);
+        return p;
+    }
+    return runq_dequeue_mlfq(rq);
+}
+
+/* Requeue every normal process at its top level. Caller holds rq->lock. */
+static void
+runq_boost(struct runq *rq, uint64_t epoch)
+{
+    struct proc *list = 0, **tailp = &list, *p;
+
+    while ((p = runq_dequeue_mlfq(rq)) != 0) {
+        *tailp = p;
+        tailp = &p->rq_next;
+    }
+    *tailp = 0;
+    while ((p = list) != 0) {
+        list = p->rq_next;
+        boost_check(p, epoch);
+        runq_enqueue(rq, p);
+    }
+    rq->epoch = epoch;
+}
+
+/* Rank of what CPU i runs or will run next, -1 if it is idle. */
+static int
+cpu_rank(int i)
+{
+    struct proc *cur = __atomic_load_n(&cpus[i].proc, __ATOMIC_RELAXED);
+    int r = runq_rtprio(&runq[i]);
+
+    if (cur)
+        r = MAX(r, rank(cur));
+    else if (!r && !__atomic_load_n(&runq[i].nr, __ATOMIC_RELAXED))
+        r = -1;
+    return r;
+}
+
+/*
+ * Wake an idle CPU for p, just queued on cpu: cpu itself, or if it
+ * is busy running something, an idle CPU that may steal p. Caller
+ * holds p->lock.
+ */
+static void
+runq_kick(int cpu, struct proc *p)
+{
+    uint64_t idle;
+
+    /* Pairs with the fence in idle(): see the queue, or be seen. */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    idle = __atomic_load_n(&idle_mask, __ATOMIC_RELAXED) & p->cpumask;
+    if (!idle)
+        return;
+    if (!(idle & CPU_BIT(cpu))) {
+        if (!__atomic_load_n(&cpus[cpu].proc, __ATOMIC_RELAXED))
+            return;
+        cpu = __builtin_ctzll(idle);
+    }
+    if (cpu != cpuid())
+        ipi_send(cpu, IPI_WAKEUP);
+}
+
+static void
+runq_push(int cpu, struct proc *p)
+{
+    struct runq *rq = &runq[cpu];
+    struct proc *cur;
+
+    acquire(&rq->lock);
+    runq_enqueue(rq, p);
+    cur = __atomic_load_n(&cpus[cpu].proc, __ATOMIC_RELAXED);
+    release(&rq->lock);
+    if (cur && rank(p) > rank(cur))
+        smp_send_reschedule(cpu);
+    else
+        runq_kick(cpu, p);
+}
+
+static struct proc *
+runq_pop(struct runq *rq)
+{
+    struct proc *p;
+    uint64_t epoch;
+
+    if (!__atomic_load_n(&rq->nr, __ATOMIC_RELAXED))
+        return 0;
+    epoch = boost_epoch();
+    acquire(&rq->lock);
+    if (rq->epoch != epoch)
+        runq_boost(rq, epoch);
+    p = runq_dequeue(rq);
+    release(&rq->lock);
+    return p;
+}
+
+/*
+ * Take the first process on rq that may run on CPU self, preferring
+ * one whose cache has gone cold among those of the same rank.
+ */
+static struct proc *
+runq_pull(struct runq *rq, int self)
+{
+    struct proc *p, *prev, *pick = 0, *pick_prev = 0;
+    struct rqlist *l, *pick_l = 0;
+    uint64_t hot = timestamp() - timerfreq() / 1000000 * CACHE_HOT_US;
+    uint64_t epoch = boost_epoch();
+    struct rqlist *order[NRTPRIO + NQUEUE];
+    int n = 0;
+
+    acquire(&rq->lock);
+    if (rq->epoch != epoch)
+        runq_boost(rq, epoch);
+    for (int prio = NRTPRIO - 1; prio > 0; prio--)
+        if (rq->rt[prio].head)
+            order[n++] = &rq->rt[prio];
+    for (int i = 0; i < NQUEUE; i++)
+        order[n++] = &rq->mlfq[i];
+
+    for (int i = 0; i < n && !pick; i++) {
+        l = order[i];
+        for (prev = 0, p = l->head; p; prev = p, p = p->rq_next) {
+            if (!(p->cpumask & CPU_BIT(self)))
+                continue;
+            if (!pick || p->last_ran < hot) {
+                pick = p;
+                pick_prev = prev;
+                pick_l = l;
+            }
+            if (p->last_ran < hot)
+                break;
+        }
+    }
+    if (pick)
+        runq_remove(rq, pick_l, pick_prev, pick);
+    release(&rq->lock);
+    return pick;
+}
+
+/* Take a process from another CPU's run queue, the longest first. */
+static struct proc *
+runq_steal(int self)
+{
+    struct proc *p;
+    int tried = CPU_BIT(self);
+
+    for (;;) {
+        struct runq *busiest = 0;
+        int max = 0, victim = 0;
+
+        for (int i = 0; i < NCPU; i++) {
+            int nr = __atomic_load_n(&runq[i].nr, __ATOMIC_RELAXED);
+            if (!(tried & CPU_BIT(i)) && nr > max) {
+                max = nr;
+                busiest = &runq[i];
+                victim = i;
+            }
+        }
+        if (!busiest)
+            return 0;
+        if ((p = runq_pull(busiest, self)) != 0)
+            return p;
+        tried |= CPU_BIT(victim);
+    }
+}
+
+/*
+ * Unlink p, which is RUNNABLE, from its run queue so that its class
+ * or level can change. Returns 0 if a scheduler has already taken p
+ * off the queue and is about to run it. Caller holds p->lock.
+ */
+static int
+runq_unlink(struct proc *p)
+{
+    struct runq *rq = &runq[p->cpu];
+    struct rqlist *l;
+    struct proc *q, *prev = 0;
+
+    acquire(&rq->lock);
+    l = runq_list(rq, p);
+    for (q = l->head; q && q != p; prev = q, q = q->rq_next)
+        ;
+    if (q)
+        runq_remove(rq, l, prev, p);
+    release(&rq->lock);
+    return q != 0;
+}
+
+/* Should the running process give way to one queued on rq? Racy, a hint. */
+static int
+runq_has_above(struct runq *rq, struct proc *p)
+{
+    if (p->policy != SCHED_OTHER)
+        return runq_rtprio(rq) > p->rtprio;
+    if (runq_rtprio(rq))
+        return 1;
+    for (int i = 0; i < p->prio; i++)
+        if (__atomic_load_n(&rq->mlfq[i].head, __ATOMIC_RELAXED))
+            return 1;
+    return 0;
+}
+
+/*
+ * Pick the run queue for p: the CPU it last ran on if allowed and
+ * not busier than the least loaded allowed CPU by more than one. A
+ * real-time process first looks for a CPU it can run on right away.
+ */
+static int
+select_cpu(struct proc *p)
+{
+    int best = -1, min = 0;
+
+    if (p->policy != SCHED_OTHER) {
+        if ((p->cpumask & CPU_BIT(p->cpu)) && cpu_rank(p->cpu) < rank(p))
+            return p->cpu;
+        for (int i = 0; i < NCPU; i++)
+            if ((p->cpumask & CPU_BIT(i)) && cpu_rank(i) < rank(p))
+                return i;
+    }
+
+    for (int i = 0; i < NCPU; i++) {
+        int nr = __atomic_load_n(&runq[i].nr, __ATOMIC_RELAXED);
+        if ((p->cpumask & CPU_BIT(i)) && (best < 0 || nr < min)) {
+            best = i;
+            min = nr;
+        }
+    }
+    if ((p->cpumask & CPU_BIT(p->cpu)) &&
+        __atomic_load_n(&runq[p->cpu].nr, __ATOMIC_RELAXED) <= min + 1)
+        return p->cpu;
+    return best;
+}
+
+/* Make p RUNNABLE and queue it. Caller holds p->lock. */
+static void
+make_runnable(struct proc *p)
+{
+    boost_check(p, boost_epoch());
+    p->state = RUNNABLE;
+    p->cpu = select_cpu(p);
+    runq_push(p->cpu, p);
+}
+
 // int nextpid = 1;
 struct {
     int nextpid;
@@ -46,6 +516,13 @@ proc_init()
     /* TODO: Your code here. */
     initlock(&ptable.lock, "proc table");
     initlock(&nextpid.lock, "nextpid");
+    initlock(&wait_lock, "wait_lock");
+    for (int i = 0; i < NWAITQ; i++)
+        initlock(&waitq[i].lock, "waitq");
+    for (int i = 0; i < NCPU; i++)
+        initlock(&runq[i].lock, "runq");
+    for (struct proc *p = ptable.proc; p < ptable.proc + NPROC; p++)
+        initlock(&p->lock, "proc");
 }
 
 /*
@@ -72,8 +549,11 @@ proc_alloc()
         return NULL;
     }
 
-    // kstack
-    char* sp = kalloc();
+    p->state = EMBRYO;
+    release(&ptable.lock);
+
+    // kstack, only the trapframe and context below need clearing
+    char* sp = kalloc_nozero();
     if (sp == NULL) {
         p->state = UNUSED;
         return 0;
@@ -98,9 +578,15 @@ proc_alloc()
 
     // other settings
     p->pid = alloc_pid();
-    p->state = EMBRYO;
-
-    release(&ptable.lock);
+    p->cpu = cpuid();
+    p->cpumask = CPUMASK_ALL;
+    p->last_ran = 0;
+    p->policy = SCHED_OTHER;
+    p->rtprio = 0;
+    p->nice = 0;
+    p->prio = 0;
+    p->slice = 0;
+    p->epoch = boost_epoch();
 
     return p;
 }
@@ -137,40 +623,34 @@ user_init()
     p->tf->ELR_EL1 = 0;
 
     strncpy(p->name, "initcode", sizeof(p->name));
-    p->state = RUNNABLE;
     p->cwd = namei("/");
     p->sz = PGSIZE;
+
+    acquire(&p->lock);
+    make_runnable(p);
+    release(&p->lock);
 }
 
-void user_idle_init()
+/*
+ * Run with interrupts off by a CPU that found nothing to run: zero
+ * some free pages for later kalloc() calls, then sleep in wfi until
+ * an interrupt, such as a timer or the IPI from runq_kick(), comes.
+ */
+static void
+idle(int cpu)
 {
-    struct proc* p;
-    /* for why our symbols differ from xv6, please refer https://stackoverflow.com/questions/10486116/what-does-this-gcc-error-relocation-truncated-to-fit-mean */
-    extern char _binary_obj_user_initcode_start[], _binary_obj_user_initcode_size[];
-
-    p = proc_alloc();
-
-    if (p == NULL) {
-        panic("user_init: cannot allocate a process");
-    }
-    if ((p->pgdir = pgdir_init()) == NULL) {
-        panic("user_init: cannot allocate a pagetable");
-    }
-
-    initproc = p;
-
-    //start in loop
-    uvm_init(p->pgdir, _binary_obj_user_initcode_start + (7 << 2), (long)(_binary_obj_user_initcode_size - (7 << 2)));
-
-    // tf
-    memset(p->tf, 0, sizeof(*(p->tf)));
-    p->tf->SPSR_EL1 = 0;
-    p->tf->SP_EL0 = PGSIZE;
-    p->tf->x30 = 0;
-    p->tf->ELR_EL1 = 0;
-
-    p->state = RUNNABLE;
-    p->sz = PGSIZE;
+    kalloc_zero_refill();
+
+    __atomic_fetch_or(&idle_mask, CPU_BIT(cpu), __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    /* A push that missed our bit in idle_mask sent no IPI. */
+    if (!__atomic_load_n(&runq[cpu].nr, __ATOMIC_RELAXED))
+        wfi();
+    __atomic_fetch_and(&idle_mask, ~CPU_BIT(cpu), __ATOMIC_RELAXED);
+
+    /* Take the interrupt that woke us up. */
+    sti();
+    cli();
 }
 
 /*
@@ -187,46 +667,77 @@ scheduler()
 {
     struct proc *p;
     struct cpu *c = thiscpu;
+    int ticking = 1;
     c->proc = NULL;
     
     for (;;) {
-        /* Loop over process table looking for process to run. */
+        /* Take the next process from our run queue, or steal one. */
         /* TODO: Your code here. */
-        acquire(&ptable.lock);
-        for (p = ptable.proc; p < ptable.proc + NPROC; p++) {
-            if (p->state == RUNNABLE) {
-                c->proc = p;
-                uvm_switch(p);
-                p->state = RUNNING;
-                // cprintf("scheduler: process id %d takes the cpu %d\n", p->pid, cpuid());
-                swtch(&c->scheduler, p->context);
-
-                // back
-                c->proc = NULL;
+        int cpu = cpuid();
+        if ((p = runq_pop(&runq[cpu])) == 0 &&
+            (p = runq_steal(cpu)) == 0) {
+            /* Nothing to run: no tick needed until there is. */
+            if (ticking) {
+                timer_stop();
+                ticking = 0;
             }
+            idle(cpu);
+            continue;
+        }
+        if (!ticking) {
+            timer_reset();
+            ticking = 1;
+        }
 
+        acquire(&p->lock);
+        if (p->state == RUNNABLE && !(p->cpumask & CPU_BIT(cpu))) {
+            /* Its affinity changed while it was queued here. */
+            make_runnable(p);
+        } else if (p->state == RUNNABLE) {
+            c->need_resched = 0;
+            c->proc = p;
+            p->cpu = cpuid();
+            uvm_switch(p);
+            p->state = RUNNING;
+            // cprintf("scheduler: process id %d takes the cpu %d\n", p->pid, cpuid());
+            swtch(&c->scheduler, p->context);
+
+            // back
+            c->proc = NULL;
+            p->last_ran = timestamp();
         }
-        release(&ptable.lock);
+        release(&p->lock);
     }
 }
 
 /*
- * Enter scheduler.  Must hold only ptable.lock
+ * Enter scheduler.  Must hold only p->lock
+ * and have changed p->state.
  */
 void
 sched()
 {
     /* TODO: Your code here. */
-    struct proc* p = thiscpu->proc;
-    if (!holding(&ptable.lock)) {
-        panic("sched: not holding ptable lock");
-    }
+    struct proc* p = thisproc();
+    int intena;
 
+    if (!holding(&p->lock)) {
+        panic("sched: not holding p->lock");
+    }
+    if (thiscpu->noff != 1) {
+        panic("sched: holding other locks");
+    }
     if (p->state == RUNNING) {
         panic("sched: process running");
     }
+    if (intr_get()) {
+        panic("sched: interruptible");
+    }
 
+    /* intena belongs to this kernel thread, not to the CPU. */
+    intena = thiscpu->intena;
     swtch(&p->context, thiscpu->scheduler);
+    thiscpu->intena = intena;
 }
 
 /*
@@ -236,10 +747,10 @@ void
 forkret()
 {
     /* TODO: Your code here. */
-    //release ptable.lok that is aquired in scheduler
-    release(&ptable.lock);
+    //release p->lock that is aquired in scheduler
+    release(&thisproc()->lock);
 
-    if (thiscpu->proc->pid == 1) {
+    if (thisproc()->pid == 1) {
         initlog(ROOTDEV);
         // sd_test();
         cprintf("init the log successfully\n");
@@ -250,14 +761,6 @@ forkret()
     return;
 }
 
-void wakeup_withlock(void* chan) {
-    for (struct proc* p = ptable.proc; p < ptable.proc + NPROC; p++) {
-        if (p->state == SLEEPING && p->chan == chan) {
-            p->state = RUNNABLE;
-        }
-    }
-}
-
 /*
  * Exit the current process.  Does not return.
  * An exited process remains in the zombie state
@@ -266,7 +769,7 @@ void wakeup_withlock(void* chan) {
 void
 exit()
 {
-    struct proc *p = thiscpu->proc;
+    struct proc *p = thisproc();
     /* TODO: Your code here. */
     if (p == initproc) {
         panic("exit: init process shall not exit!");
@@ -280,17 +783,22 @@ exit()
     }
     iput(thisproc()->cwd);
     thisproc()->cwd = 0;
-    acquire(&ptable.lock);
-    wakeup_withlock(p->parent);
+    uvm_vma_free(p);
+    acquire(&wait_lock);
+    wakeup(p->parent);
     for (struct proc* p = ptable.proc;p < ptable.proc + NPROC; p++) {
         if (p->parent == thisproc()) {
             p->parent = initproc;
             if (p->state == ZOMBIE) {
-                wakeup_withlock(p->parent);
+                wakeup(p->parent);
             }
         }
     }
+
+    /* wait() must not free us before sched() is off our stack. */
+    acquire(&p->lock);
     p->state = ZOMBIE;
+    release(&wait_lock);
     sched();
 
     // never exit
@@ -305,29 +813,38 @@ void
 sleep(void *chan, struct spinlock *lk)
 {
     /* TODO: Your code here. */
-    struct proc* p = thiscpu->proc;
+    struct proc* p = thisproc();
+    struct waitq *wq = waitq_of(chan);
 
     if (p == 0) {
         panic("sleep");
     }
-
-
-    if (lk != &ptable.lock) {
-        acquire(&ptable.lock);
-        release(lk);
+    if (lk == &p->lock) {
+        panic("sleep: p->lock");
     }
 
+    /*
+     * Once wq->lock is held no wakeup(chan) can be missed, since
+     * wakeup() needs it too, so it is safe to release lk.
+     */
+    acquire(&wq->lock);
+    release(lk);
+
     p->chan = chan;
     p->state = SLEEPING;
-
-
+    p->wq_next = wq->head;
+    wq->head = p;
+
+    /*
+     * wakeup() needs p->lock to make us RUNNABLE, which it cannot
+     * get before sched() has switched away.
+     */
+    acquire(&p->lock);
+    release(&wq->lock);
     sched();
-    p->chan = 0;
+    release(&p->lock);
 
-    if (lk != &ptable.lock) {
-        release(&ptable.lock);
-        acquire(lk);
-    }
+    acquire(lk);
 }
 
 /* Wake up all processes sleeping on chan. */
@@ -335,15 +852,27 @@ void
 wakeup(void *chan)
 {
     /* TODO: Your code here. */
-    struct proc* p;
-
-    acquire(&ptable.lock);
-    for (p = ptable.proc; p < &ptable.proc[NPROC]; p++) {
-        if (p->state == SLEEPING && p->chan == chan) {
-            p->state = RUNNABLE;
+    struct waitq *wq = waitq_of(chan);
+    struct proc **pp, *p;
+
+    acquire(&wq->lock);
+    for (pp = &wq->head; (p = *pp) != 0; ) {
+        if (p->chan == chan) {
+            *pp = p->wq_next;
+            p->wq_next = 0;
+            p->chan = 0;
+            acquire(&p->lock);
+            /* Gave up the CPU early: climb a level. */
+            if (p->policy == SCHED_OTHER && p->prio > prio_top(p))
+                p->prio--;
+            p->slice = 0;
+            make_runnable(p);
+            release(&p->lock);
+        } else {
+            pp = &p->wq_next;
         }
     }
-    release(&ptable.lock);
+    release(&wq->lock);
 }
 
 /* Give up CPU. */
@@ -351,12 +880,221 @@ void
 yield()
 {
     /* TODO: Your code here. */
-    acquire(&ptable.lock);
-    struct proc* p = thiscpu->proc;
-    p->state = RUNNABLE;
+    struct proc* p = thisproc();
+    acquire(&p->lock);
+    make_runnable(p);
     // cprintf("yield: process id %d gives up the cpu %d\n", p->pid, cpuid());
     sched();
-    release(&ptable.lock);
+    release(&p->lock);
+}
+
+/*
+ * Called from the timer interrupt. Charges the tick to the running
+ * process, which has to give up the CPU when a process that outranks
+ * it is waiting on this CPU, or once it has used its quantum. A
+ * normal process then drops a level, a SCHED_RR one goes behind the
+ * others of its priority, and a SCHED_FIFO one has no quantum. The
+ * switch itself happens in preempt_check() at the end of the trap.
+ */
+void
+proc_tick()
+{
+    struct proc *p = thisproc();
+    int resched = 0;
+
+    if (p == 0)
+        return;
+    if (runq_has_above(&runq[cpuid()], p)) {
+        resched = 1;
+    } else if (p->policy == SCHED_RR) {
+        if (++p->slice >= RR_QUANTUM) {
+            p->slice = 0;
+            resched = 1;
+        }
+    } else if (p->policy == SCHED_OTHER) {
+        if (++p->slice >= MLFQ_QUANTUM(p->prio)) {
+            if (p->prio < prio_bottom(p))
+                p->prio++;
+            p->slice = 0;
+            resched = 1;
+        }
+    }
+    if (resched)
+        thiscpu->need_resched = 1;
+}
+
+/*
+ * Called at the end of every trap: switch away if this CPU was asked
+ * to reschedule. Interrupts are only taken while this CPU holds no
+ * spinlock, but a copy-on-write fault in the kernel may hit while it
+ * holds one, so check.
+ */
+void
+preempt_check()
+{
+    if (thisproc() && thiscpu->noff == 0 &&
+        __atomic_load_n(&thiscpu->need_resched, __ATOMIC_RELAXED))
+        yield();
+}
+
+/*
+ * Explicit preemption point for long kernel loops. Does nothing if
+ * the caller holds a spinlock, which makes it safe to call from
+ * helpers that are sometimes run under one.
+ */
+void
+cond_resched()
+{
+    int resched;
+
+    push_off();
+    resched = thiscpu->noff == 1 && thiscpu->proc &&
+              __atomic_load_n(&thiscpu->need_resched, __ATOMIC_RELAXED);
+    pop_off();
+    if (resched)
+        yield();
+}
+
+/* Find the process with the given pid, 0 meaning the caller. */
+static struct proc *
+proc_find(int pid)
+{
+    if (pid == 0)
+        return thisproc();
+    for (struct proc *p = ptable.proc; p < ptable.proc + NPROC; p++)
+        if (p->state != UNUSED && p->pid == pid)
+            return p;
+    return 0;
+}
+
+/*
+ * Restrict process pid to the CPUs in mask. Returns -1 if there is
+ * no such process or mask has no CPU in it.
+ */
+int
+setaffinity(int pid, uint64_t mask)
+{
+    struct proc *p;
+
+    if ((mask &= CPUMASK_ALL) == 0 || (p = proc_find(pid)) == 0)
+        return -1;
+
+    acquire(&p->lock);
+    p->cpumask = mask;
+    release(&p->lock);
+
+    /* Move off this CPU now if it is no longer allowed. */
+    if (p == thisproc() && !(mask & CPU_BIT(cpuid())))
+        yield();
+    return 0;
+}
+
+int
+getaffinity(int pid, uint64_t *mask)
+{
+    struct proc *p;
+
+    if ((p = proc_find(pid)) == 0)
+        return -1;
+    *mask = p->cpumask;
+    return 0;
+}
+
+/* Set the nice value of a process. Returns -1 if there is no such process. */
+int
+setpriority(int pid, int nice)
+{
+    struct proc *p;
+    int queued;
+
+    if ((p = proc_find(pid)) == 0)
+        return -1;
+
+    acquire(&p->lock);
+    queued = p->state == RUNNABLE && runq_unlink(p);
+    p->nice = MIN(MAX(nice, -NZERO), NZERO - 1);
+    if (p->prio < prio_top(p) || p->prio > prio_bottom(p)) {
+        p->prio = MIN(MAX(p->prio, prio_top(p)), prio_bottom(p));
+        p->slice = 0;
+    }
+    if (queued)
+        make_runnable(p);
+    release(&p->lock);
+    return 0;
+}
+
+int
+getpriority(int pid, int *nice)
+{
+    struct proc *p;
+
+    if ((p = proc_find(pid)) == 0)
+        return -1;
+    *nice = p->nice;
+    return 0;
+}
+
+/*
+ * Set the scheduling policy and real-time priority of a process.
+ * Returns -1 if there is no such process or the priority does not
+ * fit the policy.
+ */
+int
+setscheduler(int pid, int policy, int rtprio)
+{
+    struct proc *p;
+    int queued;
+
+    if (policy == SCHED_OTHER ? rtprio != 0 :
+        (policy != SCHED_FIFO && policy != SCHED_RR) || rtprio < 1 || rtprio >= NRTPRIO)
+        return -1;
+    if ((p = proc_find(pid)) == 0)
+        return -1;
+
+    acquire(&p->lock);
+    /* A queued process has to move to the list of its new class. */
+    queued = p->state == RUNNABLE && runq_unlink(p);
+    p->policy = policy;
+    p->rtprio = rtprio;
+    p->slice = 0;
+    if (queued)
+        make_runnable(p);
+    release(&p->lock);
+
+    /* Lowered below something queued here: give way. */
+    if (p == thisproc() && runq_has_above(&runq[cpuid()], p))
+        yield();
+    return 0;
+}
+
+int
+getscheduler(int pid, int *policy, int *rtprio)
+{
+    struct proc *p;
+
+    if ((p = proc_find(pid)) == 0)
+        return -1;
+    *policy = p->policy;
+    *rtprio = p->rtprio;
+    return 0;
+}
+
+/*
+ * Return the time slice of process pid in timer ticks, 0 if it has
+ * none (SCHED_FIFO), or -1.
+ */
+int
+proc_timeslice(int pid)
+{
+    struct proc *p;
+
+    if ((p = proc_find(pid)) == 0)
+        return -1;
+    if (p->policy == SCHED_FIFO)
+        return 0;
+    if (p->policy == SCHED_RR)
+        return RR_QUANTUM;
+    return MLFQ_QUANTUM(p->prio);
 }
 
 /*
@@ -378,7 +1116,7 @@ fork()
     }
 
     // Copy process state from p.
-    if ((np->pgdir = copyuvm(thisproc()->pgdir, thisproc()->sz)) == 0) {
+    if ((np->pgdir = copyuvm(thisproc())) == 0) {
         kfree(np->kstack);
         np->kstack = 0;
         np->state = UNUSED;
@@ -386,7 +1124,9 @@ fork()
     }
 
     np->sz = thisproc()->sz;
+    acquire(&wait_lock);
     np->parent = thisproc();
+    release(&wait_lock);
     memmove(np->tf, thisproc()->tf, sizeof(struct trapframe));
 
     // Clear r0 so that fork returns 0 in the child.
@@ -400,9 +1140,24 @@ fork()
 
     np->cwd = idup(thisproc()->cwd);
 
+    memmove(np->vma, thisproc()->vma, sizeof(np->vma));
+    for (i = 0; i < NVMA; i++) {
+        if (np->vma[i].ip) {
+            idup(np->vma[i].ip);
+        }
+    }
+
     pid = np->pid;
-    np->state = RUNNABLE;
     strncpy(np->name, thisproc()->name, sizeof(thisproc()->name));
+    np->nice = thisproc()->nice;
+    np->cpumask = thisproc()->cpumask;
+    np->policy = thisproc()->policy;
+    np->rtprio = thisproc()->rtprio;
+    np->prio = prio_top(np);
+
+    acquire(&np->lock);
+    make_runnable(np);
+    release(&np->lock);
 
     return pid;
 }
@@ -417,8 +1172,10 @@ wait()
     /* TODO: Your code here. */
     struct proc* p;
     int havekids, pid;
+    char *kstack;
+    uint64_t *pgdir;
 
-    acquire(&ptable.lock);
+    acquire(&wait_lock);
 
     for (;;) {
         // Scan through table looking for zombie children.
@@ -432,30 +1189,39 @@ wait()
             havekids = 1;
 
             if (p->state == ZOMBIE) {
-                // Found one.
+                // Found one. Its exit() has left the CPU once p->lock is ours.
                 pid = p->pid;
-                kfree(p->kstack);
+                acquire(&p->lock);
+                kstack = p->kstack;
+                pgdir = p->pgdir;
                 p->kstack = 0;
-                vm_free(p->pgdir, 1);
-                p->state = UNUSED;
+                p->pgdir = 0;
                 p->pid = 0;
                 p->parent = 0;
                 p->name[0] = 0;
                 p->killed = 0;
+                release(&p->lock);
+
+                acquire(&ptable.lock);
+                p->state = UNUSED;
                 release(&ptable.lock);
+                release(&wait_lock);
 
+                /* Free the address space preemptibly, outside the locks. */
+                kfree(kstack);
+                vm_free(pgdir, 0);
                 return pid;
             }
         }
 
         // No point waiting if we don't have any children.
         if (!havekids || thisproc()->killed) {
-            release(&ptable.lock);
+            release(&wait_lock);
             return -1;
         }
 
-        // Wait for children to exit.  (See wakeup1 call in proc_exit.)
-        sleep(thisproc(), &ptable.lock);  //DOC: wait-sleep
+        // Wait for children to exit.  (See wakeup call in exit.)
+        sleep(thisproc(), &wait_lock);  //DOC: wait-sleep
     }
 }
 
@@ -474,7 +1240,6 @@ procdump()
     };
 
     cprintf("\n====== PROCESS DUMP ======\n");
-    acquire(&ptable.lock);
     for (struct proc* p = ptable.proc; p < &ptable.proc[NPROC]; ++p) {
         if (p->state == UNUSED) continue;
         char* state =
@@ -484,19 +1249,22 @@ procdump()
         cprintf("[%s] %d (%s)\n", state, p->pid, p->name);
     }
     cprintf("====== DUMP END ======\n\n");
-    release(&ptable.lock);
 }
 
+/*
+ * Grow or shrink the address space by n bytes. Growing only moves
+ * the break: the pages are mapped on first touch, see uvm_fault().
+ */
 int growproc(int n)
 {
     uint32_t sz;
     sz = thisproc()->sz;
 
     if (n > 0) {
-        if ((sz = allocuvm(thisproc()->pgdir, sz, sz + n)) == 0) {
+        if ((uint64_t)sz + n >= UADDR_SZ) {
             return -1;
         }
-
+        sz += n;
     }
     else if (n < 0) {
         if ((sz = deallocuvm(thisproc()->pgdir, sz, sz + n)) == 0) {
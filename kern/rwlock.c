@@ -0,0 +1,66 @@
+#include "arm.h"
+#include "spinlock.h"
+#include "rwlock.h"
+#include "console.h"
+
+/*
+ * Waiters sleep in wfe between attempts. Every release does a sev,
+ * and the event register latches it, so a release that lands
+ * between a failed attempt and the wfe is not lost.
+ */
+
+void
+initrwlock(struct rwlock *lk, char *name)
+{
+    lk->name = name;
+    lk->cnt = 0;
+    lk->wwait = 0;
+}
+
+void
+read_acquire(struct rwlock *lk)
+{
+    push_off();
+    for (;;) {
+        int32_t c = __atomic_load_n(&lk->cnt, __ATOMIC_RELAXED);
+        if (c >= 0 && !__atomic_load_n(&lk->wwait, __ATOMIC_RELAXED) &&
+            __atomic_compare_exchange_n(&lk->cnt, &c, c + 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+        asm volatile("wfe");
+    }
+}
+
+void
+read_release(struct rwlock *lk)
+{
+    if (__atomic_sub_fetch(&lk->cnt, 1, __ATOMIC_RELEASE) < 0)
+        panic("read_release: %s not read-locked\n", lk->name);
+    asm volatile("sev");
+    pop_off();
+}
+
+void
+write_acquire(struct rwlock *lk)
+{
+    push_off();
+    __atomic_add_fetch(&lk->wwait, 1, __ATOMIC_RELAXED);
+    for (;;) {
+        int32_t c = 0;
+        if (__atomic_compare_exchange_n(&lk->cnt, &c, -1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+        asm volatile("wfe");
+    }
+    __atomic_sub_fetch(&lk->wwait, 1, __ATOMIC_RELAXED);
+}
+
+void
+write_release(struct rwlock *lk)
+{
+    if (lk->cnt != -1)
+        panic("write_release: %s not write-locked\n", lk->name);
+    __atomic_store_n(&lk->cnt, 0, __ATOMIC_RELEASE);
+    asm volatile("sev");
+    pop_off();
+}
@@ -664,31 +664,20 @@ sdrw(struct buf* b)
     /* TODO: Your code here. */
     // add to the list, if list is empty, then use sd_start
     // then sleep, use loop to check whether buf flag is modified, if modified, then break
-    int flag;
-    flag = list_empty(&sdque);
-    list_push(b, &sdque);
-
-    // cprintf("sdbegin");
-
     acquire(&sdlock);
 
-
+    /* The queue is shared with sd_intr(), only touch it under sdlock. */
+    int flag = list_empty(&sdque);
+    list_push(b, &sdque);
     if (flag) {
         sd_start(list_front(&sdque));
     }
 
-
-    while (1) {
+    //flags = 100 -> 010
+    while (!((b->flags & B_VALID) && (~b->flags & B_DIRTY))) {
         sleep((void*)b, &sdlock);
-        //flags = 100 -> 010
-        // cprintf("!!@#!@");
-        if ((b->flags & B_VALID) && (~b->flags & B_DIRTY)) {
-            break;
-        }
-
     }
-    if (holding(&sdlock))
-        release(&sdlock);
+    release(&sdlock);
 }
 
 /* SD card test and benchmark. */
@@ -0,0 +1,207 @@
+/*
+ * Slab allocator.
+ *
+ * A kmem_cache hands out objects of one size. Objects are carved
+ * out of single pages (slabs) obtained from kalloc(); each slab
+ * starts with a struct slab header that records which of its
+ * objects are free. The free list is kept as an index array in the
+ * header instead of inside the objects, so that an object keeps the
+ * state its constructor gave it while it sits in the cache.
+ *
+ * In front of the slabs every CPU has a magazine of up to
+ * SLAB_CPU_MAX objects. kmem_cache_alloc() and kmem_cache_free()
+ * only touch the calling CPU's magazine and take the cache lock to
+ * move half a magazine at a time. Like kalloc(), these must not be
+ * called from interrupt handlers.
+ */
+
+#include <stdint.h>
+
+#include "types.h"
+#include "mmu.h"
+#include "string.h"
+#include "console.h"
+#include "kalloc.h"
+#include "spinlock.h"
+#include "slab.h"
+
+struct slab {
+    struct kmem_cache *cache;
+    struct slab *next;
+    struct slab *prev;
+    int inuse;          /* Objects handed out */
+    int free;           /* Index of first free object, or -1 */
+    uint16_t nextfree[]; /* Index of the next free object */
+};
+
+static struct kmem_cache *cache_chain;
+
+static inline char *
+slab_base(struct kmem_cache *c, struct slab *s)
+{
+    return (char *)s + ROUNDUP(sizeof(struct slab) + c->objs_per_slab * sizeof(uint16_t), 8);
+}
+
+static void
+slab_push(struct slab **head, struct slab *s)
+{
+    s->prev = 0;
+    s->next = *head;
+    if (*head)
+        (*head)->prev = s;
+    *head = s;
+}
+
+static void
+slab_unlink(struct slab **head, struct slab *s)
+{
+    if (s->prev)
+        s->prev->next = s->next;
+    else
+        *head = s->next;
+    if (s->next)
+        s->next->prev = s->prev;
+}
+
+void
+kmem_cache_init(struct kmem_cache *c, char *name, size_t size, void (*ctor)(void *))
+{
+    size_t hdr = sizeof(struct slab);
+
+    memset(c, 0, sizeof(*c));
+    c->name = name;
+    c->size = ROUNDUP(MAX(size, sizeof(void *)), 8);
+    c->ctor = ctor;
+    c->objs_per_slab = (PGSIZE - hdr - 8) / (c->size + sizeof(uint16_t));
+    if (c->objs_per_slab < 1)
+        panic("kmem_cache_init: %s objects too large\n", name);
+    initlock(&c->lock, name);
+
+    c->next = __atomic_load_n(&cache_chain, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&cache_chain, &c->next, c, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+}
+
+/* Get a fresh slab with every object constructed. Caller holds c->lock. */
+static struct slab *
+slab_new(struct kmem_cache *c)
+{
+    struct slab *s = (struct slab *)kalloc();
+    if (!s)
+        return 0;
+
+    s->cache = c;
+    s->inuse = 0;
+    s->free = 0;
+    char *base = slab_base(c, s);
+    for (int i = 0; i < c->objs_per_slab; i++) {
+        s->nextfree[i] = i + 1;
+        if (c->ctor)
+            c->ctor(base + i * c->size);
+    }
+    s->nextfree[c->objs_per_slab - 1] = (uint16_t)-1;
+    c->nslabs++;
+    slab_push(&c->partial, s);
+    return s;
+}
+
+/* Move up to n objects from the slabs into cc. */
+static void
+cache_refill(struct kmem_cache *c, struct kmem_cache_cpu *cc, int n)
+{
+    struct slab *s;
+
+    acquire(&c->lock);
+    while (n-- > 0) {
+        if (!(s = c->partial) && !(s = slab_new(c)))
+            break;
+        cc->objs[cc->n++] = slab_base(c, s) + s->free * c->size;
+        s->free = s->nextfree[s->free] == (uint16_t)-1 ? -1 : s->nextfree[s->free];
+        if (++s->inuse == c->objs_per_slab) {
+            slab_unlink(&c->partial, s);
+            slab_push(&c->full, s);
+        }
+    }
+    release(&c->lock);
+}
+
+/* Give n objects of cc back to their slabs. */
+static void
+cache_flush(struct kmem_cache *c, struct kmem_cache_cpu *cc, int n)
+{
+    acquire(&c->lock);
+    while (n-- > 0 && cc->n > 0) {
+        char *obj = cc->objs[--cc->n];
+        struct slab *s = ROUNDDOWN((struct slab *)obj, PGSIZE);
+        int idx = (obj - slab_base(c, s)) / c->size;
+
+        if (s->cache != c)
+            panic("kmem_cache_free: %s object from %s\n", c->name, s->cache->name);
+
+        if (s->inuse-- == c->objs_per_slab) {
+            slab_unlink(&c->full, s);
+            slab_push(&c->partial, s);
+        }
+        s->nextfree[idx] = s->free < 0 ? (uint16_t)-1 : s->free;
+        s->free = idx;
+
+        /* Keep the last slab around, give empty ones back. */
+        if (s->inuse == 0 && (s->next || s->prev)) {
+            slab_unlink(&c->partial, s);
+            c->nslabs--;
+            kfree((char *)s);
+        }
+    }
+    release(&c->lock);
+}
+
+/* Allocate a constructed object, or return 0 if out of memory. */
+void *
+kmem_cache_alloc(struct kmem_cache *c)
+{
+    struct kmem_cache_cpu *cc;
+    void *obj = 0;
+
+    preempt_disable();
+    cc = &c->cpu[cpuid()];
+    if (cc->n == 0)
+        cache_refill(c, cc, SLAB_CPU_MAX / 2);
+    if (cc->n > 0) {
+        cc->nalloc++;
+        obj = cc->objs[--cc->n];
+    }
+    preempt_enable();
+    return obj;
+}
+
+void
+kmem_cache_free(struct kmem_cache *c, void *obj)
+{
+    struct kmem_cache_cpu *cc;
+
+    preempt_disable();
+    cc = &c->cpu[cpuid()];
+    if (cc->n == SLAB_CPU_MAX)
+        cache_flush(c, cc, SLAB_CPU_MAX / 2);
+    cc->objs[cc->n++] = obj;
+    cc->nfree++;
+    preempt_enable();
+}
+
+/* Print per-cache statistics to the console. */
+void
+kmem_cache_dump()
+{
+    cprintf("\n====== SLAB DUMP ======\n");
+    for (struct kmem_cache *c = cache_chain; c; c = c->next) {
+        uint64_t nalloc = 0, nfree = 0;
+        for (int i = 0; i < NCPU; i++) {
+            nalloc += c->cpu[i].nalloc;
+            nfree += c->cpu[i].nfree;
+        }
+        cprintf("%s: size %d, %lld slabs, %lld active, %lld allocs, %lld frees\n",
+                c->name, (int)c->size, c->nslabs, nalloc - nfree, nalloc, nfree);
+    }
+    cprintf("====== DUMP END ======\n\n");
+}
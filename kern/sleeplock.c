@@ -1,22 +1,71 @@
+#include "arm.h"
+#include "console.h"
 #include "sleeplock.h"
 
+/* How long acquiresleep() spins on a running holder before sleeping. */
+#define SLEEPLOCK_SPIN_US 20
+
+/* Totals over all sleep locks, for sleeplock_dump(). */
+static uint64_t total_spin, total_sleep;
+
 void
 initsleeplock(struct sleeplock *lk, char *name)
 {
   initlock(&lk->lk, name);
   lk->locked = 0;
   lk->pid = 0;
+  lk->owner = 0;
+  lk->nspin = lk->nsleep = 0;
+}
+
+/*
+ * Wait for lk with lk->lk dropped, as long as its holder is running
+ * on another CPU and at most SLEEPLOCK_SPIN_US. Called and returns
+ * with lk->lk held; returns whether lk became free.
+ */
+static int
+spin_on_owner(struct sleeplock *lk)
+{
+  uint64_t t0 = timestamp();
+  uint64_t limit = timerfreq() * SLEEPLOCK_SPIN_US / 1000000;
+
+  while (lk->locked) {
+    struct proc *owner = lk->owner;
+    if (!owner || owner->state != RUNNING)
+      return 0;
+
+    release(&lk->lk);
+    while (__atomic_load_n(&lk->locked, __ATOMIC_RELAXED) &&
+           __atomic_load_n(&owner->state, __ATOMIC_RELAXED) == RUNNING &&
+           timestamp() - t0 < limit)
+      asm volatile("yield");
+    acquire(&lk->lk);
+
+    if (timestamp() - t0 >= limit)
+      return !lk->locked;
+  }
+  return 1;
 }
 
 void
 acquiresleep(struct sleeplock *lk)
 {
   acquire(&lk->lk);
-  while (lk->locked) {
-    sleep(lk, &lk->lk);
+  if (lk->locked) {
+    if (spin_on_owner(lk)) {
+      lk->nspin++;
+      __atomic_add_fetch(&total_spin, 1, __ATOMIC_RELAXED);
+    } else {
+      lk->nsleep++;
+      __atomic_add_fetch(&total_sleep, 1, __ATOMIC_RELAXED);
+      while (lk->locked) {
+        sleep(lk, &lk->lk);
+      }
+    }
   }
   lk->locked = 1;
   lk->pid = thisproc()->pid;
+  lk->owner = thisproc();
   release(&lk->lk);
 }
 
@@ -26,6 +75,7 @@ releasesleep(struct sleeplock *lk)
   acquire(&lk->lk);
   lk->locked = 0;
   lk->pid = 0;
+  lk->owner = 0;
   wakeup(lk);
   release(&lk->lk);
 }
@@ -40,3 +90,12 @@ holdingsleep(struct sleeplock *lk)
   release(&lk->lk);
   return r;
 }
+
+/* Print how contended sleep locks were acquired. */
+void
+sleeplock_dump()
+{
+  cprintf("sleeplocks: %lld spin hits, %lld sleeps\n",
+          __atomic_load_n(&total_spin, __ATOMIC_RELAXED),
+          __atomic_load_n(&total_sleep, __ATOMIC_RELAXED));
+}
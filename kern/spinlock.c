@@ -1,36 +1,128 @@
+#include "types.h"
 #include "arm.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "console.h"
 #include "proc.h"
 #include "string.h"
 
+/*
+ * Statically allocated locks register themselves in initlock() so
+ * that lockstat_dump() can find them. Locks embedded in dynamically
+ * allocated objects, such as inode sleep locks, are left out.
+ * There are over 160 of them: one per process, wait queue bucket and
+ * buffer, one per CPU for the run queue and the timer, and a few more.
+ * Locks past NLOCKSTAT are counted, and lockstat_dump() reports them.
+ */
+#define NLOCKSTAT 256
+
+static struct spinlock *lockstat[NLOCKSTAT];
+static int nlockstat;
+
 /*
  * Check whether this cpu is holding the lock.
+ * Interrupts must be off.
  */
 int
 holding(struct spinlock *lk)
 {
     int hold;
-    hold = lk->locked && lk->cpu == thiscpu;
+    hold = lk->owner != lk->next && lk->cpu == thiscpu;
     return hold;
 }
 
+/*
+ * push_off/pop_off are like cli()/sti() except that they are matched:
+ * it takes two pop_off()s to undo two push_off()s. Also, if interrupts
+ * are initially off, then push_off, pop_off leaves them off.
+ */
+void
+push_off()
+{
+    int old = intr_get();
+
+    cli();
+    if (thiscpu->noff == 0)
+        thiscpu->intena = old;
+    thiscpu->noff++;
+}
+
+void
+pop_off()
+{
+    struct cpu *c = thiscpu;
+
+    if (intr_get())
+        panic("pop_off: interruptible\n");
+    if (c->noff < 1)
+        panic("pop_off: unbalanced\n");
+    if (--c->noff == 0 && c->intena)
+        sti();
+}
+
 void
 initlock(struct spinlock *lk, char *name) {
+    extern char end[];
+
     lk->name = name;
-    lk->locked = 0;
+    lk->next = lk->owner = 0;
     lk->cpu = 0;
+    lk->nacquire = lk->ncontend = lk->spin = 0;
+
+    if ((char *)lk < end) {
+        int i = __atomic_fetch_add(&nlockstat, 1, __ATOMIC_RELAXED);
+        if (i < NLOCKSTAT)
+            lockstat[i] = lk;
+    }
+}
+
+/*
+ * Wait in low-power state until lk->owner reaches ticket.
+ * release() wakes the waiters both by storing to lk->owner, which
+ * clears the exclusive monitor armed by ldaxr, and by sev. The
+ * initial sevl makes the first wfe fall through.
+ */
+static inline void
+ticket_wait(struct spinlock *lk, uint32_t ticket)
+{
+    uint32_t cur;
+
+    asm volatile(
+        "   sevl\n"
+        "1: wfe\n"
+        "   ldaxr   %w[cur], %[owner]\n"
+        "   eor     %w[cur], %w[cur], %w[ticket]\n"
+        "   cbnz    %w[cur], 1b\n"
+        : [cur]"=&r"(cur), [owner]"+Q"(lk->owner)
+        : [ticket]"r"(ticket)
+        : "memory");
 }
 
 void
 acquire(struct spinlock *lk)
 {
+    uint32_t ticket;
+    uint64_t t0 = 0;
+    int contended = 0;
+
+    /* Disable interrupts to avoid deadlock with a handler on this core. */
+    push_off();
     if (holding(lk)) {
         panic("acquire: spinlock already held\n");
     }
-    while (lk->locked || __atomic_test_and_set(&lk->locked, __ATOMIC_ACQUIRE))
-        ;
+    ticket = __atomic_fetch_add(&lk->next, 1, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&lk->owner, __ATOMIC_ACQUIRE) != ticket) {
+        contended = 1;
+        t0 = timestamp();
+        ticket_wait(lk, ticket);
+    }
     lk->cpu = thiscpu;
+
+    lk->nacquire++;
+    if (contended) {
+        lk->ncontend++;
+        lk->spin += timestamp() - t0;
+    }
 }
 
 void
@@ -40,5 +132,28 @@ release(struct spinlock *lk)
         panic("release: not locked\n");
     }
     lk->cpu = NULL;
-    __atomic_clear(&lk->locked, __ATOMIC_RELEASE);
-}
\ No newline at end of file
+    __atomic_store_n(&lk->owner, lk->owner + 1, __ATOMIC_RELEASE);
+    asm volatile("sev");
+    pop_off();
+}
+
+/* Print contention statistics of every registered lock. */
+void
+lockstat_dump()
+{
+    int nreg = __atomic_load_n(&nlockstat, __ATOMIC_RELAXED);
+    int n = MIN(nreg, NLOCKSTAT);
+
+    cprintf("\n====== LOCKSTAT DUMP ======\n");
+    for (int i = 0; i < n; i++) {
+        struct spinlock *lk = lockstat[i];
+        if (!lk->nacquire)
+            continue;
+        cprintf("%s: %lld acquires, %lld contended, %lld ticks spinning\n",
+                lk->name, lk->nacquire, lk->ncontend, lk->spin);
+    }
+    if (nreg > NLOCKSTAT)
+        cprintf("%d locks not shown, NLOCKSTAT is too small\n", nreg - NLOCKSTAT);
+    sleeplock_dump();
+    cprintf("====== DUMP END ======\n\n");
+}
@@ -3,8 +3,10 @@
 #include "proc.h"
 #include "console.h"
 #include "types.h"
+#include "mmu.h"
 #include "fs.h"
 #include "file.h"
+#include "vm.h"
 
 /*
  * User code makes a system call with SVC, system call number in r0.
@@ -16,9 +18,7 @@
 int
 fetchint(uint64_t addr, int64_t *ip)
 {
-    struct proc *proc = thiscpu->proc;
-
-    if (addr >= proc->sz || addr + 8 > proc->sz) {
+    if (fetchbuf(addr, 8, 0) < 0) {
         return -1;
     }
     *ip = *(int64_t*)(addr);
@@ -28,24 +28,26 @@ fetchint(uint64_t addr, int64_t *ip)
 /*
  * Fetch the nul-terminated string at addr from the current process.
  * Doesn't actually copy the string - just sets *pp to point at it.
- * Returns length of string, not including nul.
+ * The string may lie in the heap or in mappings, and is checked one
+ * page at a time. Returns length of string, not including nul.
  */
 int
 fetchstr(uint64_t addr, char **pp)
 {
     char *s, *ep;
-    struct proc *proc = thiscpu->proc;
-
-    if (addr >= proc->sz) {
-        return -1;
-    }
+    uint64_t a;
 
     *pp = (char*)addr;
-    ep = (char*)proc->sz;
 
-    for (s = *pp; s < ep; s++) {
-        if (*s == 0) {
-            return s - *pp;
+    for (a = addr; a >= addr; a = (uint64_t)ep) {
+        if (fetchbuf(a, 1, 0) < 0) {
+            return -1;
+        }
+        ep = (char*)ROUNDDOWN(a, PGSIZE) + PGSIZE;
+        for (s = (char*)a; s < ep; s++) {
+            if (*s == 0) {
+                return s - *pp;
+            }
         }
     }
 
@@ -54,30 +56,49 @@ fetchstr(uint64_t addr, char **pp)
 
 /*
  * Fetch the nth (starting from 0) 32-bit system call argument.
- * In our ABI, r0 contains system call index, r1-r4 contain parameters.
- * now we support system calls with at most 4 parameters.
+ * In our ABI, x8 contains system call index, x0-x5 contain parameters.
+ * now we support system calls with at most 6 parameters.
  */
 int
 argint(int n, uint64_t* ip)
 {
-    if (n > 3) {
+    if (n > 5) {
         panic("argint: too many system call parameters\n");
     }
 
-    struct proc *proc = thiscpu->proc;
+    struct proc *proc = thisproc();
 
     *ip = *(&proc->tf->x0 + n);
 
     return 0;
 }
 
+/*
+ * Check that the block of memory [addr, addr + size) lies within the
+ * process address space, the heap or a mapping, and fault in the
+ * pages of it that were never touched: the kernel may use it while
+ * holding a spinlock, where a page fault cannot sleep to read a page
+ * of the program in. If write, the kernel is going to write to the
+ * block, so it must be writable by the process.
+ */
+int
+fetchbuf(uint64_t addr, uint64_t size, int write)
+{
+    if (addr + size < addr) {
+        return -1;
+    }
+
+    return uvm_populate(thisproc(), addr, size, write);
+}
+
 /*
  * Fetch the nth word-sized system call argument as a pointer
  * to a block of memory of size n bytes.  Check that the pointer
- * lies within the process address space.
+ * lies within the process address space, and that the process may
+ * write the block if write is set.
  */
 int
-argptr(int n, char **pp, int size)
+argptr(int n, char **pp, int size, int write)
 {
     uint64_t i;
 
@@ -85,9 +106,7 @@ argptr(int n, char **pp, int size)
         return -1;
     }
 
-    struct proc *proc = thiscpu->proc;
-
-    if ((uint64_t)i >= proc->sz || (uint64_t)i + size > proc->sz) {
+    if (fetchbuf(i, size, write) < 0) {
         return -1;
     }
 
@@ -98,8 +117,9 @@ argptr(int n, char **pp, int size)
 /* 
  * Fetch the nth word-sized system call argument as a string pointer.
  * Check that the pointer is valid and the string is nul-terminated.
- * (There is no shared writable memory, so the string can't change
- * between this check and being used by the kernel.)
+ * The string is used in place, so if it lies in memory that another
+ * process can write, a MAP_SHARED mapping or the cached pages of a
+ * mapped file, it may change between this check and its use.
  */
 int
 argstr(int n, char **pp)
@@ -144,8 +164,22 @@ const int (*syscall_table[NR_SYSCALL])() = {
     [SYS_gettid] = sys_gettid,
     [SYS_rt_sigprocmask] = sys_sigprocmask,
     [SYS_brk] = (const int*)sys_brk,
+    [SYS_mmap] = sys_mmap,
+    [SYS_munmap] = sys_munmap,
+    [SYS_mprotect] = sys_mprotect,
     [SYS_execve] = sys_exec,
     [SYS_sched_yield] = sys_yield,
+    [SYS_setpriority] = sys_setpriority,
+    [SYS_getpriority] = sys_getpriority,
+    [SYS_sched_rr_get_interval] = sys_sched_rr_get_interval,
+    [SYS_clock_gettime] = sys_clock_gettime,
+    [SYS_nanosleep] = sys_nanosleep,
+    [SYS_clock_nanosleep] = sys_clock_nanosleep,
+    [SYS_sched_setaffinity] = sys_sched_setaffinity,
+    [SYS_sched_getaffinity] = sys_sched_getaffinity,
+    [SYS_sched_setscheduler] = sys_sched_setscheduler,
+    [SYS_sched_getscheduler] = sys_sched_getscheduler,
+    [SYS_sched_getparam] = sys_sched_getparam,
     [SYS_clone] = sys_clone,
     [SYS_wait4] = sys_wait4,
     [SYS_exit_group] = sys_exit,
@@ -5,6 +5,7 @@
 //
 
 #include <fcntl.h>
+#include <sys/mman.h>
 
 #include "types.h"
 #include "mmu.h"
@@ -17,6 +18,7 @@
 #include "fs.h"
 #include "file.h"
 #include "syscall.h"
+#include "vm.h"
 
 struct iovec {
     void* iov_base;    /* Starting address. */
@@ -86,7 +88,7 @@ sys_read()
     ssize_t n;
     char* p;
 
-    if (argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argptr(1, &p, n) < 0)
+    if (argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argptr(1, &p, n, 1) < 0)
         return -1;
     return fileread(f, p, n);
 }
@@ -99,7 +101,7 @@ sys_write()
     ssize_t n;
     char* p;
 
-    if (argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argptr(1, &p, n) < 0)
+    if (argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argptr(1, &p, n, 0) < 0)
         return -1;
     return filewrite(f, p, n);
 }
@@ -115,12 +117,15 @@ sys_writev()
     struct iovec* iov, * p;
     if (argfd(0, &fd, &f) < 0 ||
         argint(2, &iovcnt) < 0 ||
-        argptr(1, &iov, iovcnt * sizeof(struct iovec)) < 0) {
+        argptr(1, &iov, iovcnt * sizeof(struct iovec), 0) < 0) {
         return -1;
     }
 
     size_t tot = 0;
     for (p = iov; p < iov + iovcnt; p++) {
+        if (fetchbuf((uint64_t)p->iov_base, p->iov_len, 0) < 0) {
+            return tot ? tot : -1;
+        }
         tot += filewrite(f, p->iov_base, p->iov_len);
     }
     return tot;
@@ -150,7 +155,7 @@ sys_fstat()
     struct file* f;
     struct stat* st;
 
-    if (argfd(0, 0, &f) < 0 || argptr(1, (void*)&st, sizeof(*st)) < 0)
+    if (argfd(0, 0, &f) < 0 || argptr(1, (void*)&st, sizeof(*st), 1) < 0)
         return -1;
     return filestat(f, st);
 }
@@ -164,7 +169,7 @@ sys_fstatat()
 
     if (argint(0, &dirfd) < 0 ||
         argstr(1, &path) < 0 ||
-        argptr(2, (void*)&st, sizeof(*st)) < 0 ||
+        argptr(2, (void*)&st, sizeof(*st), 1) < 0 ||
         argint(3, &flags) < 0)
         return -1;
 
@@ -414,4 +419,69 @@ sys_exec()
     }
     // cprintf("execve path:%s", path);
     return execve(path, argv, (char**)0);
-}
\ No newline at end of file
+}
+
+/* VMA_READ and VMA_WRITE for PROT_* bits prot. */
+static int
+prot_flags(uint64_t prot)
+{
+    return ((prot & (PROT_READ | PROT_EXEC)) ? VMA_READ : 0) |
+           ((prot & PROT_WRITE) ? VMA_WRITE : 0);
+}
+
+int
+sys_mmap()
+{
+    uint64_t addr, len, prot, flags, off;
+    struct file *f = 0;
+    int vflags;
+
+    if (argint(0, &addr) < 0 || argint(1, &len) < 0 || argint(2, &prot) < 0 ||
+        argint(3, &flags) < 0 || argint(5, &off) < 0)
+        return -1;
+    if (off % PGSIZE)
+        return -1;
+
+    vflags = prot_flags(prot) | VMA_MAYWRITE;
+    switch (flags & MAP_TYPE) {
+    case MAP_SHARED:
+        vflags |= VMA_SHARED;
+        break;
+    case MAP_PRIVATE:
+        break;
+    default:
+        return -1;
+    }
+
+    if (!(flags & MAP_ANONYMOUS)) {
+        if (argfd(4, 0, &f) < 0 || f->type != FD_INODE || !f->readable)
+            return -1;
+        /* A shared mapping can only be written if the file can. */
+        if ((vflags & VMA_SHARED) && !f->writable) {
+            if (prot & PROT_WRITE)
+                return -1;
+            vflags &= ~VMA_MAYWRITE;
+        }
+    }
+    return uvm_mmap(thisproc(), addr, len, vflags, flags & MAP_FIXED, f ? f->ip : 0, off);
+}
+
+int
+sys_munmap()
+{
+    uint64_t addr, len;
+
+    if (argint(0, &addr) < 0 || argint(1, &len) < 0)
+        return -1;
+    return uvm_munmap(thisproc(), addr, len);
+}
+
+int
+sys_mprotect()
+{
+    uint64_t addr, len, prot;
+
+    if (argint(0, &addr) < 0 || argint(1, &len) < 0 || argint(2, &prot) < 0)
+        return -1;
+    return uvm_mprotect(thisproc(), addr, len, prot_flags(prot));
+}
@@ -1,8 +1,18 @@
 #include <stdint.h>
+#include <time.h>
+#include <sched.h>
 
 #include "proc.h"
 #include "trap.h"
+#include "arm.h"
 #include "console.h"
+#include "string.h"
+#include "types.h"
+#include "mmu.h"
+#include "timer.h"
+#include "syscall.h"
+#include "vm.h"
+#include "vclock.h"
 
 int
 sys_exit()
@@ -22,15 +32,14 @@ size_t
 sys_brk()
 {
     /* TODO: Your code here. */
-    size_t addr;
-    uint64_t n;
+    uint64_t addr, sz = thisproc()->sz;
 
-    if (argint(0, &n) < 0)
+    /* Like Linux, move the break to addr and return the new break. */
+    if (argint(0, &addr) < 0)
         return -1;
-    addr = thisproc()->sz;
-    if (growproc(n) < 0)
-        return -1;
-    return addr;
+    if (addr == 0 || addr >= UADDR_SZ || growproc((int64_t)addr - (int64_t)sz) < 0)
+        return sz;
+    return thisproc()->sz;
 }
 
 int
@@ -67,3 +76,205 @@ sys_wait4()
 
     return wait();
 }
+
+#define PRIO_PROCESS 0
+
+/* Only PRIO_PROCESS is supported; who 0 is the caller. */
+int
+sys_setpriority()
+{
+    uint64_t which, who;
+    int64_t prio;
+    if (argint(0, &which) < 0 ||
+        argint(1, &who) < 0 ||
+        argint(2, &prio) < 0)
+        return -1;
+    if (which != PRIO_PROCESS)
+        return -1;
+    return setpriority(who, prio);
+}
+
+/* Returns NZERO - nice like Linux, so that the result is never negative. */
+int
+sys_getpriority()
+{
+    uint64_t which, who;
+    int nice;
+    if (argint(0, &which) < 0 ||
+        argint(1, &who) < 0)
+        return -1;
+    if (which != PRIO_PROCESS || getpriority(who, &nice) < 0)
+        return -1;
+    return NZERO - nice;
+}
+
+/*
+ * The CPU mask is a single word, so only the first 8 bytes of the
+ * user's cpu_set_t matter. getaffinity returns the bytes written.
+ */
+int
+sys_sched_setaffinity()
+{
+    uint64_t pid, size, mask = 0;
+    char *set;
+    if (argint(0, &pid) < 0 ||
+        argint(1, &size) < 0 ||
+        argptr(2, &set, size, 0) < 0)
+        return -1;
+    memmove(&mask, set, MIN(size, sizeof(mask)));
+    return setaffinity(pid, mask);
+}
+
+int
+sys_sched_getaffinity()
+{
+    uint64_t pid, size, mask;
+    char *set;
+    if (argint(0, &pid) < 0 ||
+        argint(1, &size) < 0 ||
+        size < sizeof(mask) ||
+        argptr(2, &set, sizeof(mask), 1) < 0)
+        return -1;
+    if (getaffinity(pid, &mask) < 0)
+        return -1;
+    memmove(set, &mask, sizeof(mask));
+    return sizeof(mask);
+}
+
+/*
+ * musl leaves these to the caller's syscall(), since on Linux they act
+ * on threads. Here they act on processes, pid 0 being the caller.
+ */
+int
+sys_sched_setscheduler()
+{
+    uint64_t pid, policy;
+    struct sched_param *param;
+    if (argint(0, &pid) < 0 ||
+        argint(1, &policy) < 0 ||
+        argptr(2, (char **)&param, sizeof(param->sched_priority), 0) < 0)
+        return -1;
+    return setscheduler(pid, policy, param->sched_priority);
+}
+
+int
+sys_sched_getscheduler()
+{
+    uint64_t pid;
+    int policy, prio;
+    if (argint(0, &pid) < 0 || getscheduler(pid, &policy, &prio) < 0)
+        return -1;
+    return policy;
+}
+
+int
+sys_sched_getparam()
+{
+    uint64_t pid;
+    int policy;
+    struct sched_param *param;
+    if (argint(0, &pid) < 0 ||
+        argptr(1, (char **)&param, sizeof(param->sched_priority), 1) < 0)
+        return -1;
+    return getscheduler(pid, &policy, &param->sched_priority);
+}
+
+/* The round-robin interval of a process is the quantum of its level. */
+int
+sys_sched_rr_get_interval()
+{
+    uint64_t pid;
+    struct timespec *ts;
+    int64_t us;
+    if (argint(0, &pid) < 0 ||
+        argptr(1, (char **)&ts, sizeof(*ts), 1) < 0)
+        return -1;
+    if ((us = proc_timeslice(pid)) < 0)
+        return -1;
+    us *= timer_quantum();
+    ts->tv_sec = us / 1000000;
+    ts->tv_nsec = us % 1000000 * 1000;
+    return 0;
+}
+
+/*
+ * There is no real-time clock, so CLOCK_REALTIME counts from boot
+ * like CLOCK_MONOTONIC does. All clocks read the system counter,
+ * from the origin published to user space in the vclock page.
+ */
+static int
+clock_valid(uint64_t clk)
+{
+    return clk == CLOCK_REALTIME || clk == CLOCK_MONOTONIC ||
+           clk == CLOCK_MONOTONIC_RAW || clk == CLOCK_BOOTTIME;
+}
+
+/*
+ * Times too far away for the counter saturate at CYCLES_MAX instead
+ * of wrapping around to the past; a sleep until then never ends.
+ */
+#define CYCLES_MAX  (~(uint64_t)0)
+
+static uint64_t
+cycles_add(uint64_t a, uint64_t b)
+{
+    return a + b < a ? CYCLES_MAX : a + b;
+}
+
+static int
+ts_to_cycles(struct timespec *ts, uint64_t *cycles)
+{
+    uint64_t freq = timerfreq();
+
+    if (ts->tv_sec < 0 || ts->tv_nsec < 0 || ts->tv_nsec >= 1000000000)
+        return -1;
+    if ((uint64_t)ts->tv_sec >= CYCLES_MAX / freq)
+        *cycles = CYCLES_MAX;
+    else
+        *cycles = ts->tv_sec * freq + ts->tv_nsec * freq / 1000000000;
+    return 0;
+}
+
+int
+sys_clock_gettime()
+{
+    uint64_t clk, now = timestamp() - vclock->boot, freq = vclock->freq;
+    struct timespec *ts;
+    if (argint(0, &clk) < 0 ||
+        argptr(1, (char **)&ts, sizeof(*ts), 1) < 0)
+        return -1;
+    if (!clock_valid(clk))
+        return -1;
+    ts->tv_sec = now / freq;
+    ts->tv_nsec = now % freq * 1000000000 / freq;
+    return 0;
+}
+
+/* Nothing interrupts a sleep, so rem is never written. */
+int
+sys_nanosleep()
+{
+    struct timespec *req;
+    uint64_t cycles;
+    if (argptr(0, (char **)&req, sizeof(*req), 0) < 0 ||
+        ts_to_cycles(req, &cycles) < 0)
+        return -1;
+    timer_sleep_until(cycles_add(timestamp(), cycles));
+    return 0;
+}
+
+int
+sys_clock_nanosleep()
+{
+    uint64_t clk, flags, cycles;
+    struct timespec *req;
+    if (argint(0, &clk) < 0 ||
+        argint(1, &flags) < 0 ||
+        argptr(2, (char **)&req, sizeof(*req), 0) < 0)
+        return -1;
+    if (!clock_valid(clk) || ts_to_cycles(req, &cycles) < 0)
+        return -1;
+    cycles = cycles_add(cycles, flags & TIMER_ABSTIME ? vclock->boot : timestamp());
+    timer_sleep_until(cycles);
+    return 0;
+}
@@ -1,28 +1,390 @@
+#include <stdint.h>
+
 #include "timer.h"
 
+#include "types.h"
 #include "arm.h"
 #include "peripherals/irq.h"
 
 #include "console.h"
+#include "spinlock.h"
+#include "proc.h"
+
+/*
+ * Length of a scheduling tick in microseconds. The default can be
+ * changed at build time with 'make QUANTUM_US=n', and at run time
+ * with timer_set_quantum(), which ^T on the console calls, and which
+ * takes effect at each CPU's next tick.
+ */
+#ifndef QUANTUM_US
+#define QUANTUM_US 10000
+#endif
+
+/*
+ * Kernel timers live on a per-CPU hierarchical timer wheel. Level 0
+ * has WHEEL_SIZE slots of WHEEL_GRAN_US each, and every level above
+ * has slots WHEEL_SIZE times wider than the one below. When level 0
+ * wraps around, the current slot of level 1 is cascaded down, and so
+ * on up the levels, so a timer is moved at most WHEEL_LEVELS - 1
+ * times however far away it is.
+ *
+ * The wheel only buckets timers. The physical timer of the CPU is
+ * programmed with the exact deadline of the earliest timer (or of the
+ * scheduler tick, if that comes first), so timers fire at counter
+ * resolution rather than slot resolution, and a CPU whose tick is
+ * stopped is only interrupted when a timer is due.
+ */
+#define WHEEL_BITS      6
+#define WHEEL_SIZE      (1 << WHEEL_BITS)
+#define WHEEL_MASK      (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS    4
+#define WHEEL_GRAN_US   1000
+
+#define NEVER           (~(uint64_t)0)
+
+#define CNTKCTL_EL0VCTEN    (1 << 1)    /* EL0 may read cntvct_el0 */
+
+struct timer_base {
+    struct spinlock lock;
+    uint64_t clk;               /* Next level 0 slot to run, in slots */
+    int npending[WHEEL_LEVELS];
+    int ticking;                /* Is the scheduler tick running? */
+    uint64_t tick_at;           /* Deadline of the next tick */
+    struct timer_list *wheel[WHEEL_LEVELS][WHEEL_SIZE];
+} __attribute__((aligned(CACHELINE)));
+
+static struct timer_base bases[NCPU];
+
+static uint64_t quantum_us = QUANTUM_US;
+
+/* Tick length in counter cycles. */
+static uint64_t
+tick_cycles()
+{
+    return timerfreq() * __atomic_load_n(&quantum_us, __ATOMIC_RELAXED) / 1000000;
+}
+
+/* Width of a level 0 slot in counter cycles. */
+static uint64_t
+slot_cycles()
+{
+    return timerfreq() * WHEEL_GRAN_US / 1000000;
+}
+
+static void
+enqueue(struct timer_base *b, struct timer_list *t)
+{
+    uint64_t slot = t->expires / slot_cycles(), delta;
+    struct timer_list **head;
+    int lvl;
+
+    /* Expired timers go to the slot that runs next. */
+    if (slot < b->clk)
+        slot = b->clk;
+    delta = slot - b->clk;
+    for (lvl = 0; lvl < WHEEL_LEVELS - 1; lvl++)
+        if (delta >> ((lvl + 1) * WHEEL_BITS) == 0)
+            break;
+    /* Too far away: park it in the last slot, it is requeued from there. */
+    if (delta >> (WHEEL_LEVELS * WHEEL_BITS))
+        slot = b->clk + (1ULL << (WHEEL_LEVELS * WHEEL_BITS)) - 1;
+
+    head = &b->wheel[lvl][(slot >> (lvl * WHEEL_BITS)) & WHEEL_MASK];
+    t->lvl = lvl;
+    t->next = *head;
+    if (*head)
+        (*head)->pprev = &t->next;
+    t->pprev = head;
+    *head = t;
+    b->npending[lvl]++;
+}
+
+static void
+dequeue(struct timer_base *b, struct timer_list *t)
+{
+    *t->pprev = t->next;
+    if (t->next)
+        t->next->pprev = t->pprev;
+    t->pprev = 0;
+    b->npending[t->lvl]--;
+}
 
-static int dt = 19200000;
+/* Requeue the timers of the current slot of level lvl. Returns its index. */
+static int
+cascade(struct timer_base *b, int lvl)
+{
+    int idx = (b->clk >> (lvl * WHEEL_BITS)) & WHEEL_MASK;
+    struct timer_list *t = b->wheel[lvl][idx], *next;
+
+    b->wheel[lvl][idx] = 0;
+    for (; t; t = next) {
+        next = t->next;
+        b->npending[lvl]--;
+        enqueue(b, t);
+    }
+    return idx;
+}
+
+static int
+pending(struct timer_base *b)
+{
+    int n = 0;
+    for (int lvl = 0; lvl < WHEEL_LEVELS; lvl++)
+        n += b->npending[lvl];
+    return n;
+}
+
+/*
+ * Advance the wheel to now and unlink the timers that are due.
+ * Returns them as a list chained through next.
+ */
+static struct timer_list *
+collect_expired(struct timer_base *b, uint64_t now)
+{
+    uint64_t now_slot = now / slot_cycles();
+    struct timer_list *done = 0, *t, *next;
+
+    for (;;) {
+        /* Nothing to cascade or run on the way. */
+        if (!pending(b)) {
+            b->clk = MAX(b->clk, now_slot);
+            break;
+        }
+        for (t = b->wheel[0][b->clk & WHEEL_MASK]; t; t = next) {
+            next = t->next;
+            if (t->expires <= now) {
+                dequeue(b, t);
+                t->next = done;
+                done = t;
+            }
+        }
+        /* The current slot may still hold timers due later in it. */
+        if (b->clk >= now_slot)
+            break;
+        if ((++b->clk & WHEEL_MASK) == 0)
+            for (int lvl = 1; lvl < WHEEL_LEVELS && cascade(b, lvl) == 0; lvl++)
+                ;
+    }
+    return done;
+}
+
+/* Earliest deadline the wheel needs an interrupt for. */
+static uint64_t
+next_expiry(struct timer_base *b)
+{
+    uint64_t next = NEVER;
+
+    for (int i = 0; i < WHEEL_SIZE && next == NEVER; i++)
+        for (struct timer_list *t = b->wheel[0][(b->clk + i) & WHEEL_MASK]; t; t = t->next)
+            next = MIN(next, t->expires);
+
+    /* Timers on the upper levels only need the next cascade. */
+    for (int lvl = 1; lvl < WHEEL_LEVELS; lvl++) {
+        if (b->npending[lvl]) {
+            next = MIN(next, ((b->clk | WHEEL_MASK) + 1) * slot_cycles());
+            break;
+        }
+    }
+    return next;
+}
+
+/* Program this CPU's physical timer. Caller holds b->lock. */
+static void
+program(struct timer_base *b)
+{
+    uint64_t next = next_expiry(b);
+
+    if (b->ticking)
+        next = MIN(next, b->tick_at);
+    if (next == NEVER) {
+        asm volatile("msr cntp_ctl_el0, %[x]" : : [x]"r"(0));
+        return;
+    }
+    asm volatile("msr cntp_cval_el0, %[x]" : : [x]"r"(next));
+    asm volatile("msr cntp_ctl_el0, %[x]" : : [x]"r"(1));
+}
 
 void
 timer_init()
 {
-    asm volatile("msr cntp_ctl_el0, %[x]" : : [x]"r"(1));
-    asm volatile("msr cntp_tval_el0, %[x]" : : [x]"r"(dt));
+    struct timer_base *b = &bases[cpuid()];
+
+    initlock(&b->lock, "timer");
+    asm volatile("msr cntkctl_el1, %[x]" : : [x]"r"((uint64_t)CNTKCTL_EL0VCTEN));
+    acquire(&b->lock);
+    b->clk = timestamp() / slot_cycles();
+    b->ticking = 1;
+    b->tick_at = timestamp() + tick_cycles();
+    program(b);
+    release(&b->lock);
     put32(CORE_TIMER_CTRL(cpuid()), CORE_TIMER_ENABLE);
 }
 
+/*
+ * Handle this CPU's timer interrupt: run the expired timers and
+ * re-arm. Returns 1 if a scheduler tick is due.
+ */
+int
+timer_intr()
+{
+    struct timer_base *b = &bases[cpuid()];
+    struct timer_list *t, *next;
+    uint64_t now = timestamp();
+    int tick = 0;
+
+    acquire(&b->lock);
+    t = collect_expired(b, now);
+    if (b->ticking && now >= b->tick_at) {
+        b->tick_at = now + tick_cycles();
+        tick = 1;
+    }
+    program(b);
+    release(&b->lock);
+
+    /* Handlers run unlocked, and may re-arm their timer. */
+    for (; t; t = next) {
+        next = t->next;
+        t->fn(t);
+    }
+    return tick;
+}
+
+/* Start the scheduler tick, restarting it if timer_stop() stopped it. */
 void
 timer_reset()
 {
-    asm volatile("msr cntp_tval_el0, %[x]" : : [x]"r"(dt));
+    struct timer_base *b = &bases[cpuid()];
+
+    acquire(&b->lock);
+    b->ticking = 1;
+    b->tick_at = timestamp() + tick_cycles();
+    program(b);
+    release(&b->lock);
+}
+
+/*
+ * Stop this CPU's tick, for a CPU that has nothing to run. Pending
+ * timers still interrupt it when they are due.
+ */
+void
+timer_stop()
+{
+    struct timer_base *b = &bases[cpuid()];
+
+    acquire(&b->lock);
+    b->ticking = 0;
+    program(b);
+    release(&b->lock);
+}
+
+void
+timer_set_quantum(uint64_t us)
+{
+    if (us)
+        __atomic_store_n(&quantum_us, us, __ATOMIC_RELAXED);
+}
+
+uint64_t
+timer_quantum()
+{
+    return __atomic_load_n(&quantum_us, __ATOMIC_RELAXED);
+}
+
+void
+timer_setup(struct timer_list *t, void (*fn)(struct timer_list *))
+{
+    t->fn = fn;
+    t->next = 0;
+    t->pprev = 0;
+}
+
+/* Queue t on wheel b. Caller holds b->lock and runs on b's CPU. */
+static void
+arm(struct timer_base *b, struct timer_list *t, uint64_t expires)
+{
+    if (t->pprev)
+        panic("add_timer: timer already pending\n");
+    t->expires = expires;
+    t->cpu = b - bases;
+    enqueue(b, t);
+    program(b);
+}
+
+/*
+ * Arm t to fire at counter value expires, on the calling CPU. Adding
+ * and deleting a timer must be serialized by its owner.
+ */
+void
+add_timer(struct timer_list *t, uint64_t expires)
+{
+    struct timer_base *b;
+
+    push_off();
+    b = &bases[cpuid()];
+    acquire(&b->lock);
+    arm(b, t, expires);
+    release(&b->lock);
+    pop_off();
+}
+
+/*
+ * Cancel t. Returns 1 if it was pending. Does not wait for a handler
+ * that is already running on another CPU.
+ */
+int
+del_timer(struct timer_list *t)
+{
+    struct timer_base *b = &bases[t->cpu];
+    int was_pending;
+
+    acquire(&b->lock);
+    if ((was_pending = t->pprev != 0))
+        dequeue(b, t);
+    release(&b->lock);
+    return was_pending;
+}
+
+struct sleeper {
+    struct timer_list timer;
+    int done;                   /* Protected by the wheel's lock */
+};
+
+static void
+sleeper_fn(struct timer_list *t)
+{
+    struct sleeper *s = (struct sleeper *)t;
+    struct timer_base *b = &bases[t->cpu];
+
+    acquire(&b->lock);
+    s->done = 1;
+    wakeup(s);
+    release(&b->lock);
+}
+
+/* Sleep until the system counter reaches expires. */
+void
+timer_sleep_until(uint64_t expires)
+{
+    struct sleeper s;
+    struct timer_base *b;
+
+    if (expires <= timestamp())
+        return;
+    timer_setup(&s.timer, sleeper_fn);
+    s.done = 0;
+
+    push_off();
+    b = &bases[cpuid()];
+    acquire(&b->lock);
+    pop_off();
+    arm(b, &s.timer, expires);
+    while (!s.done)
+        sleep(&s, &b->lock);
+    release(&b->lock);
 }
 
 /*
- * This is a per-cpu non-stable version of clock, frequency of 
+ * This is a per-cpu non-stable version of clock, frequency of
  * which is determined by cpu clock (may be tuned for power saving).
  */
 void
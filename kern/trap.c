@@ -12,6 +12,8 @@
 #include "timer.h"
 #include "proc.h"
 #include "sd.h"
+#include "ipi.h"
+#include "vm.h"
 
 void
 irq_init()
@@ -28,9 +30,11 @@ interrupt(struct trapframe *tf)
 {
     int src = get32(IRQ_SRC_CORE(cpuid()));
     if (src & IRQ_CNTPNSIRQ) {
-        timer_reset();
         // timer(); clear log
-        yield();
+        if (timer_intr())
+            proc_tick();
+    } else if (src & IRQ_MBOX(IPI_MBOX)) {
+        ipi_intr();
     } else if (src & IRQ_TIMER) {
         clock_reset();
         // clock(); clear log
@@ -48,12 +52,37 @@ interrupt(struct trapframe *tf)
     }
 }
 
+/*
+ * Handle a data abort at fault_addr, from user space or from a system
+ * call touching user memory. The first touch of a page maps it, and a
+ * write to a copy-on-write page copies it. Reading a page of a file
+ * mapping in sleeps, which is only allowed if cansleep. Returns -1
+ * for any other fault.
+ */
+static int
+dabort(uint64_t fault_addr, int iss, int cansleep)
+{
+    struct proc *p = thisproc();
+
+    if (p == 0)
+        return -1;
+    switch (iss & ISS_DFSC_MASK) {
+    case DFSC_TRANS:
+        return uvm_fault(p, fault_addr, cansleep);
+    case DFSC_PERM:
+        if (iss & ISS_WNR)
+            return uvm_wfault(p, fault_addr);
+    }
+    return -1;
+}
+
 void
 trap(struct trapframe *tf)
 {
     int ec = resr() >> EC_SHIFT, iss = resr() & ISS_MASK;
     lesr(0);  /* Clear esr. */
     uint64_t fault_addr;
+    int r, cansleep;
     switch (ec) {
     case EC_UNKNOWN:
         interrupt(tf);
@@ -63,18 +92,53 @@ trap(struct trapframe *tf)
         if (iss == 0) {
             /* Jump to syscall to handle the system call from user process */
             /* TODO: Your code here. */
+            /* System calls run with interrupts on, so they can be preempted. */
+            sti();
             syscall(tf);
+            cli();
         } else {
             cprintf("unexpected svc iss 0x%x\n", iss);
         }
         break;
     case EC_DABORT:
         asm("MRS %[r], FAR_EL1": [r] "=r" (fault_addr)::);
-        cprintf("data abort: instruction 0x%x, fault addr 0x%llx\n", tf->ELR_EL1, fault_addr);
-        while (1);
+        /* Like system calls, user faults run with interrupts on. */
+        sti();
+        if (dabort(fault_addr, iss, 1) < 0) {
+            cprintf("data abort: pid %d, instruction 0x%llx, fault addr 0x%llx\n",
+                    thisproc()->pid, tf->ELR_EL1, fault_addr);
+            exit();
+        }
+        cli();
+        break;
+    case EC_IABORT:
+        asm("MRS %[r], FAR_EL1": [r] "=r" (fault_addr)::);
+        /* Program text is read in on its first instruction fetch. */
+        sti();
+        if ((iss & ISS_DFSC_MASK) != DFSC_TRANS ||
+            uvm_fault(thisproc(), fault_addr, 1) < 0) {
+            cprintf("instruction abort: pid %d, instruction 0x%llx, iss 0x%x\n",
+                    thisproc()->pid, tf->ELR_EL1, iss);
+            exit();
+        }
+        cli();
+        break;
+    case EC_DABORT_EL1:
+        asm("MRS %[r], FAR_EL1": [r] "=r" (fault_addr)::);
+        /* Sleep only if the kernel could have slept where it faulted. */
+        cansleep = thiscpu->noff == 0 && !(tf->SPSR_EL1 & SPSR_I);
+        if (cansleep)
+            sti();
+        r = dabort(fault_addr, iss, cansleep);
+        cli();
+        if (r < 0)
+            panic("kernel data abort: instruction 0x%llx, fault addr 0x%llx, iss 0x%x\n",
+                  tf->ELR_EL1, fault_addr, iss);
+        break;
     default:
         panic("trap: unexpected irq.\n");
     }
+    preempt_check();
 }
 
 void
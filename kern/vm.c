@@ -8,8 +8,16 @@
 #include "vm.h"
 #include "kalloc.h"
 #include "proc.h"
+#include "arm.h"
+#include "ipi.h"
+#include "vclock.h"
+#include "fs.h"
+#include "file.h"
+#include "log.h"
+#include "pcache.h"
 
 extern uint64_t *kpgdir;
+struct vclock *vclock;
 
 /* 
  * Given 'pgdir', a pointer to a page directory, pgdir_walk returns
@@ -90,12 +98,12 @@ static int
 map_region(uint64_t *pgdir, void *va, uint64_t size, uint64_t pa, int64_t perm)
 {
     /* TODO: Your code here. */
-    uint64_t* va_current, * va_end;
+    uint64_t va_current, va_end;
     uint64_t* pte;
-    va_current = (uint64_t*)PTE_ADDR(va);
-    va_end = (uint64_t*)PTE_ADDR(va + size - 1);
+    va_current = PTE_ADDR(va);
+    va_end = PTE_ADDR(va + size - 1);
     while (1) {
-        if ((pte = pgdir_walk(pgdir, va_current, 1)) == 0)//let pte be the pointer of the end of the table page
+        if ((pte = pgdir_walk(pgdir, (void*)va_current, 1)) == 0)//let pte be the pointer of the end of the table page
             return -1;
         if (*pte & PTE_P)
             panic("this pte %llx is mapped\n", *pte);
@@ -108,10 +116,60 @@ map_region(uint64_t *pgdir, void *va, uint64_t size, uint64_t pa, int64_t perm)
     return 0;
 }
 
+/*
+ * Is none of the aligned CONT_SIZE run at base mapped yet? All its
+ * entries live in the same last-level table.
+ */
+static int
+cont_free(uint64_t* pgdir, uint64_t base)
+{
+    uint64_t* pte = pgdir_walk(pgdir, (void*)base, 0);
+
+    if (pte == 0) {
+        return 1;
+    }
+    for (int i = 0; i < (1 << CONT_ORDER); i++) {
+        if (pte[i] & PTE_P) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Turn the PTE_CONT run around va, if there is one, back into single
+ * pages before one of them is changed. The entries of a run must
+ * agree, so all of them are invalidated and flushed from the TLBs
+ * before they come back without the hint (break-before-make).
+ */
+static void
+cont_split(uint64_t* pgdir, uint64_t va)
+{
+    uint64_t base = ROUNDDOWN(va, CONT_SIZE), old[1 << CONT_ORDER];
+    uint64_t* pte = pgdir_walk(pgdir, (void*)base, 0);
+    int i;
+
+    if (pte == 0 || !(pte[(va - base) / PGSIZE] & PTE_CONT)) {
+        return;
+    }
+    for (i = 0; i < (1 << CONT_ORDER); i++) {
+        old[i] = pte[i];
+        pte[i] = 0;
+    }
+    tlb_shootdown(base, CONT_SIZE);
+    for (i = 0; i < (1 << CONT_ORDER); i++) {
+        pte[i] = old[i] & ~PTE_CONT;
+    }
+}
+
 /* 
  * Free a page table.
  *
  * Hint: You need to free all existing PTEs for this pgdir.
+ *
+ * level is the level of pgdir, 0 for a whole address space. Mapped
+ * pages are released with page_put(), since copy-on-write fork may
+ * share them with other address spaces.
  */
 
 void
@@ -125,19 +183,14 @@ vm_free(uint64_t *pgdir, int level)
                 //P2V because pte holds physical address 
                 //kernel run in virtul address must use virtual address.
                 vm_free((uint64_t*)(P2V(PTE_ADDR(pte))), level + 1);
-            else if (level == 3) {
-                //P2V because pte holds physical address 
-                //kernel run in virtul address must use virtual address.
-                kfree((char*)P2V(PTE_ADDR(pte)));
-            }
+            else
+                page_put((char*)P2V(PTE_ADDR(pte)));
+            cond_resched();
         }
     }
-    if (level < 3)
-        kfree((char*)pgdir); 
     //no P2V bacause in vm_free previous level 
     //we call this vm_free level with virtual address
-
-    return;
+    kfree((char*)pgdir); 
 }
 
 
@@ -146,7 +199,6 @@ vm_test()
 {
     *((int64_t*)P2V(0)) = 0xac;
     char* p = kalloc();
-    memset(p, 0, PGSIZE);
     map_region((uint64_t*)p, (void*)0x1000, PGSIZE, 0, 0);
 
     //V2P beacuse ttbr0_el1 must hold physical address of page table
@@ -160,7 +212,25 @@ vm_test()
     }
 }
 
-/* Get a new page table */
+/*
+ * Fill in the clock data page shared by all processes. The kernel
+ * keeps the first reference to it and every address space takes
+ * another, so vm_free() never frees it.
+ */
+void
+vclock_init()
+{
+    if ((vclock = (struct vclock *)kalloc()) == 0)
+        panic("vclock_init: cannot alloc a page");
+    vclock->freq = timerfreq();
+    vclock->boot = timestamp();
+}
+
+/*
+ * Get a new page table, with the clock data page mapped read-only
+ * at VCLOCK_VA. Its normal memory attributes keep user reads
+ * coherent with the kernel's cached writes.
+ */
 uint64_t *
 pgdir_init()
 {
@@ -169,7 +239,12 @@ pgdir_init()
     if (ret == NULL) {
         panic("pgdir_init: unable to allocate a page table");
     }
-    memset(ret, 0, PGSIZE);
+    if (map_region(ret, (void*)VCLOCK_VA, PGSIZE, V2P(vclock),
+                   PTE_USER | PTE_RO | PTE_PAGE | (MT_NORMAL << 2) | PTE_SH) < 0) {
+        vm_free(ret, 0);
+        return NULL;
+    }
+    page_get((char*)vclock);
     return ret;
 }
 
@@ -191,7 +266,6 @@ uvm_init(uint64_t *pgdir, char *binary, int sz)
     if (r == NULL) {
         panic("uvm_init: cannot alloc a page");
     }
-    memset(r, 0, PGSIZE);
     //V2P to physical address 
     //map_region require pa with physical address
     map_region(pgdir, (void*)0, PGSIZE, V2P(r), PTE_USER | PTE_RW | PTE_PAGE);
@@ -238,8 +312,8 @@ int allocuvm(uint64_t* pgdir, uint32_t oldsz, uint32_t newsz)
             return 0;
         }
 
-        memset(mem, 0, PGSIZE);
         map_region(pgdir, (char*)a, PGSIZE, V2P(mem), PTE_USER);
+        cond_resched();
     }
 
     return newsz;
@@ -261,8 +335,8 @@ int deallocuvm(uint64_t* pgdir, uint32_t oldsz, uint32_t newsz)
 
         if (!pte) {
             // pte == 0 --> no page table for this entry
-            // round it up to the next page directory
-            a = ROUNDUP(a, BKSIZE);
+            // skip to the last page it would have covered
+            a = ROUNDDOWN(a, BKSIZE) + BKSIZE - PGSIZE;
 
         }
         else if ((*pte & (PTE_PAGE | PTE_P)) != 0) {
@@ -272,9 +346,11 @@ int deallocuvm(uint64_t* pgdir, uint32_t oldsz, uint32_t newsz)
                 panic("deallocuvm");
             }
 
-            kfree(P2V(pa));
+            cont_split(pgdir, a);
+            page_put(P2V(pa));
             *pte = 0;
         }
+        cond_resched();
     }
 
     return newsz;
@@ -336,6 +412,10 @@ void clearpteu(uint64_t* pgdir, char* uva)
     *pte = (*pte & ~(PTE_USER | PTE_RO)) | PTE_RW;
 }
 
+/*
+ * Get the kernel address of user page uva, for the kernel to write
+ * to. A copy-on-write page is made private first.
+ */
 char* uva2ka(uint64_t* pgdir, char* uva)
 {
     uint64_t* pte;
@@ -343,7 +423,11 @@ char* uva2ka(uint64_t* pgdir, char* uva)
     pte = pgdir_walk(pgdir, uva, 0);
 
     // make sure it exists
-    if ((*pte & (PTE_TABLE | PTE_P)) == 0) {
+    if (pte == 0 || (*pte & (PTE_TABLE | PTE_P)) == 0) {
+        return 0;
+    }
+
+    if ((*pte & PTE_COW) && uvm_cow(pgdir, (uint64_t)uva) < 0) {
         return 0;
     }
 
@@ -386,44 +470,612 @@ int copyout(uint64_t* pgdir, uint32_t va, void* p, uint32_t len)
     return 0;
 }
 
-uint64_t* copyuvm(uint64_t* pgdir, uint32_t sz)
+/*
+ * Map a zeroed page at va with permissions perm, for a page of the
+ * heap or of an anonymous mapping that has never been touched.
+ * If the aligned CONT_SIZE run around va lies within [lo, hi) and
+ * none of it is mapped yet, the whole run is mapped at once from
+ * physically contiguous memory with PTE_CONT, so that it takes one
+ * TLB entry instead of 2^CONT_ORDER. Returns -1 if va is already
+ * mapped or memory ran out.
+ */
+static int
+demand(uint64_t* pgdir, uint64_t va, uint64_t perm, uint64_t lo, uint64_t hi)
 {
-    uint64_t* d;
     uint64_t* pte;
-    uint64_t pa, i, ap;
+    uint64_t base = ROUNDDOWN(va, CONT_SIZE);
     char* mem;
 
-    // allocate a new first level page directory
-    d = pgdir_init();
-    if (d == NULL) {
-        return NULL;
+    va = ROUNDDOWN(va, PGSIZE);
+    if ((pte = pgdir_walk(pgdir, (void*)va, 0)) != 0 && (*pte & PTE_P)) {
+        return -1;
+    }
+    if (base >= lo && base + CONT_SIZE <= hi && cont_free(pgdir, base) &&
+        (mem = kalloc_pages(CONT_ORDER)) != 0) {
+        if (map_region(pgdir, (void*)base, CONT_SIZE, V2P(mem), perm | PTE_CONT) < 0) {
+            kfree_pages(mem, CONT_ORDER);
+            return -1;
+        }
+        return 0;
     }
+    if ((mem = kalloc()) == 0) {
+        return -1;
+    }
+    if (map_region(pgdir, (void*)va, PGSIZE, V2P(mem), perm) < 0) {
+        kfree(mem);
+        return -1;
+    }
+    return 0;
+}
 
-    // copy the whole address space over (no COW)
-    for (i = 0; i < sz; i += PGSIZE) {
+static struct vma *
+vma_find(struct proc* p, uint64_t va)
+{
+    for (struct vma* v = p->vma; v < p->vma + NVMA; v++) {
+        if (v->end && va >= v->start && va < v->end) {
+            return v;
+        }
+    }
+    return 0;
+}
+
+/*
+ * PTE permissions for a page of v. Pages that v may write but that
+ * are shared with the page cache or another address space (!own) are
+ * mapped copy-on-write, unless v is a shared mapping. Pages of shared
+ * file mappings start out read-only and clean, and the first write
+ * to one makes it writable and dirty (see uvm_wfault()).
+ */
+static uint64_t
+vma_perm(struct vma* v, int own)
+{
+    uint64_t perm = 0;
+
+    if (v->flags & (VMA_READ | VMA_WRITE)) {
+        perm |= PTE_USER;
+    }
+    if (!(v->flags & VMA_WRITE) || (v->ip && (v->flags & VMA_SHARED))) {
+        perm |= PTE_RO;
+    } else if (!own && !(v->flags & VMA_SHARED)) {
+        perm |= PTE_RO | PTE_COW;
+    }
+    return perm;
+}
+
+/*
+ * Map the page at va of file mapping v. Whole pages of file data are
+ * shared with the page cache: read-only, copy-on-write or, for a
+ * shared mapping, read-only until the first write. The page where
+ * the data of a private writable mapping ends gets a private copy,
+ * so the zeros that follow (its bss) are really zero.
+ */
+static int
+vma_fault(uint64_t* pgdir, struct vma* v, uint64_t va)
+{
+    uint64_t off = v->off + (va - v->start), n, perm;
+    char* mem;
+
+    if (va >= v->fend) {
+        return demand(pgdir, va, vma_perm(v, 1), ROUNDUP(v->fend, PGSIZE), v->end);
+    }
+
+    if (va + PGSIZE > v->fend && (v->flags & VMA_WRITE) && !(v->flags & VMA_SHARED)) {
+        n = v->fend - va;
+        if ((mem = kalloc()) == 0) {
+            return -1;
+        }
+        ilock(v->ip);
+        if (readi(v->ip, mem, off, n) != n) {
+            iunlock(v->ip);
+            kfree(mem);
+            return -1;
+        }
+        iunlock(v->ip);
+        perm = vma_perm(v, 1);
+    } else {
+        if ((mem = pcache_get(v->ip, off, v->flags & VMA_SHARED)) == 0) {
+            return -1;
+        }
+        perm = vma_perm(v, 0);
+    }
+
+    if (map_region(pgdir, (void*)va, PGSIZE, V2P(mem), perm) < 0) {
+        page_put(mem);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Map the page at va of p, which has never been touched. Pages of
+ * file mappings are read in and may sleep, unless cansleep is 0, in
+ * which case they fail. Pages of anonymous mappings and of the heap
+ * below p->sz are zero-filled.
+ */
+int uvm_fault(struct proc* p, uint64_t va, int cansleep)
+{
+    struct vma* v;
+    uint64_t lo = 0, hi = p->sz;
+
+    va = ROUNDDOWN(va, PGSIZE);
+    if ((v = vma_find(p, va)) == 0) {
+        if (va >= p->sz) {
+            return -1;
+        }
+        // the heap part of [0, sz) around va, between program segments
+        for (v = p->vma; v < p->vma + NVMA; v++) {
+            if (v->end && v->end <= va) {
+                lo = MAX(lo, v->end);
+            } else if (v->end && v->start > va) {
+                hi = MIN(hi, v->start);
+            }
+        }
+        return demand(p->pgdir, va, PTE_USER, lo, hi);
+    }
+    if (!(v->flags & (VMA_READ | VMA_WRITE))) {
+        return -1;
+    }
+    if (v->ip == 0) {
+        return demand(p->pgdir, va, vma_perm(v, 1), v->start, v->end);
+    }
+    if (!cansleep) {
+        return -1;
+    }
+    return vma_fault(p->pgdir, v, va);
+}
+
+/*
+ * Handle a write to the read-only page at va of p: copy it if it is
+ * copy-on-write, or mark it dirty if it is a clean page of a shared
+ * file mapping, so that it is written back to the file.
+ */
+int uvm_wfault(struct proc* p, uint64_t va)
+{
+    struct vma* v = vma_find(p, va);
+    uint64_t* pte;
+
+    if (v ? !(v->flags & VMA_WRITE) : va >= p->sz) {
+        return -1;
+    }
+    if (v && v->ip && (v->flags & VMA_SHARED)) {
+        pte = pgdir_walk(p->pgdir, (void*)va, 0);
+        if (pte == 0 || !(*pte & PTE_P)) {
+            return -1;
+        }
+        *pte = (*pte & ~PTE_RO) | PTE_DIRTY;
+        tlb_shootdown(va, PGSIZE);
+        return 0;
+    }
+    return uvm_cow(p->pgdir, va);
+}
+
+/*
+ * Fault in the untouched pages of [va, va + len) of p, so that the
+ * kernel can use them while it holds a spinlock, where a fault must
+ * not sleep. If write, also make them writable, copying pages that
+ * are copy-on-write, so that the kernel never takes a write fault it
+ * cannot handle. Returns -1 if part of the range is not mapped, is
+ * not accessible to p, or, if write, is not writable by p.
+ */
+int uvm_populate(struct proc* p, uint64_t va, uint64_t len, int write)
+{
+    uint64_t a, *pte;
+
+    for (a = ROUNDDOWN(va, PGSIZE); a < va + len; a += PGSIZE) {
+        if (a >= p->sz && !vma_find(p, a)) {
+            return -1;
+        }
+        pte = pgdir_walk(p->pgdir, (void*)a, 0);
+        if (pte == 0 || !(*pte & PTE_P)) {
+            if (uvm_fault(p, a, 1) < 0) {
+                return -1;
+            }
+            pte = pgdir_walk(p->pgdir, (void*)a, 0);
+        }
+        if (!(*pte & PTE_USER)) {
+            return -1;
+        }
+        if (write && (*pte & PTE_RO) && uvm_wfault(p, a) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Write the dirty pages of [start, end) of shared file mapping v back
+ * to the file, in pieces small enough for one log transaction each.
+ * The file does not grow: data past its end is dropped. Called just
+ * before the pages are unmapped, so they are not marked clean again.
+ */
+static void
+vma_writeback(struct proc* p, struct vma* v, uint64_t start, uint64_t end)
+{
+    int max = ((LOGSIZE - 4) >> 1) * 512;
+    uint64_t a, off, n, *pte;
+
+    for (a = start; a < end; a += PGSIZE) {
+        pte = pgdir_walk(p->pgdir, (void*)a, 0);
+        if (pte == 0 || !(*pte & PTE_P) || !(*pte & PTE_DIRTY)) {
+            continue;
+        }
+        off = v->off + (a - v->start);
+        for (uint64_t i = 0; i < PGSIZE; i += n) {
+            n = MIN(max, PGSIZE - i);
+            begin_op();
+            ilock(v->ip);
+            if (off + i < v->ip->size) {
+                writei(v->ip, (char*)P2V(PTE_ADDR(*pte)) + i, off + i,
+                       MIN(n, v->ip->size - off - i));
+            }
+            iunlock(v->ip);
+            end_op();
+        }
+    }
+}
+
+static int
+vma_dirty(struct vma* v)
+{
+    return v->ip && (v->flags & VMA_SHARED) && (v->flags & VMA_MAYWRITE);
+}
+
+/* Release the slot of v, whose pages have been dealt with. */
+static void
+vma_release(struct vma* v)
+{
+    if (v->ip) {
+        begin_op();
+        iput(v->ip);
+        end_op();
+    }
+    memset(v, 0, sizeof(*v));
+}
+
+/* Cut v in two at page-aligned addr, which lies inside it. */
+static int
+vma_split(struct proc* p, struct vma* v, uint64_t addr)
+{
+    struct vma* w;
+
+    for (w = p->vma; w < p->vma + NVMA && w->end; w++)
+        ;
+    if (w == p->vma + NVMA) {
+        return -1;
+    }
+    *w = *v;
+    w->start = addr;
+    w->off = v->off + (addr - v->start);
+    v->end = addr;
+    if (w->ip) {
+        idup(w->ip);
+    }
+    return 0;
+}
+
+/*
+ * Make the mappings of p that overlap [start, end) end at its bounds,
+ * so that each one is either inside the range or outside it.
+ */
+static int
+vma_clip(struct proc* p, uint64_t start, uint64_t end)
+{
+    struct vma* v;
+
+again:
+    for (v = p->vma; v < p->vma + NVMA; v++) {
+        if (!v->end || v->end <= start || v->start >= end) {
+            continue;
+        }
+        if (v->start < start) {
+            if (vma_split(p, v, start) < 0) {
+                return -1;
+            }
+            goto again;
+        }
+        if (v->end > end && vma_split(p, v, end) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Unmap the pages of v, writing shared file data back first. */
+static void
+vma_unmap(struct proc* p, struct vma* v)
+{
+    uint64_t a, *pte;
+
+    if (vma_dirty(v)) {
+        vma_writeback(p, v, v->start, v->end);
+    }
+    for (a = v->start; a < v->end; a += PGSIZE) {
+        if ((pte = pgdir_walk(p->pgdir, (void*)a, 0)) == 0) {
+            a = ROUNDDOWN(a, BKSIZE) + BKSIZE - PGSIZE;
+            continue;
+        }
+        if (*pte & PTE_P) {
+            cont_split(p->pgdir, a);
+            page_put((char*)P2V(PTE_ADDR(*pte)));
+            *pte = 0;
+        }
+        cond_resched();
+    }
+    tlb_shootdown(v->start, v->end - v->start);
+}
+
+/*
+ * Find len bytes of the mmap area that no mapping uses, top down.
+ * Mappings of at least CONT_SIZE are aligned to it, so that their
+ * pages can be mapped in PTE_CONT runs.
+ */
+static uint64_t
+vma_gap(struct proc* p, uint64_t len)
+{
+    uint64_t align = len >= CONT_SIZE ? CONT_SIZE : PGSIZE;
+    uint64_t end = MMAP_TOP, start, next;
+
+    while (end - MMAP_BASE >= len) {
+        start = ROUNDDOWN(end - len, align);
+        if (start < MMAP_BASE) {
+            break;
+        }
+        next = end;
+        for (struct vma* v = p->vma; v < p->vma + NVMA; v++) {
+            if (v->end && v->start < start + len && v->end > start) {
+                next = MIN(next, v->start);
+            }
+        }
+        if (next == end) {
+            return start;
+        }
+        end = next;
+    }
+    return 0;
+}
+
+/*
+ * Map len bytes at addr, or anywhere in the mmap area unless fixed,
+ * with flags VMA_*. The mapping is of ip from offset off, or
+ * anonymous if ip is 0. Pages are faulted in on first touch, except
+ * those of shared anonymous mappings, which must exist before fork()
+ * to be shared with the child. Returns the address, or -1.
+ */
+uint64_t uvm_mmap(struct proc* p, uint64_t addr, uint64_t len, int flags, int fixed,
+                  struct inode* ip, uint64_t off)
+{
+    struct vma* v;
+    uint64_t a, *pte;
+
+    len = ROUNDUP(len, PGSIZE);
+    if (len == 0 || len > MMAP_TOP - MMAP_BASE) {
+        return -1;
+    }
+    if (fixed) {
+        if (addr % PGSIZE || addr < MMAP_BASE || addr > MMAP_TOP - len) {
+            return -1;
+        }
+        if (uvm_munmap(p, addr, len) < 0) {
+            return -1;
+        }
+    } else if ((addr = vma_gap(p, len)) == 0) {
+        return -1;
+    }
+
+    for (v = p->vma; v < p->vma + NVMA && v->end; v++)
+        ;
+    if (v == p->vma + NVMA) {
+        return -1;
+    }
+    v->start = addr;
+    v->end = addr + len;
+    v->fend = v->end;
+    v->off = off;
+    v->flags = flags;
+    v->ip = ip ? idup(ip) : 0;
+
+    if (!ip && (flags & VMA_SHARED)) {
+        for (a = v->start; a < v->end; a += PGSIZE) {
+            // skip pages already mapped as part of a run
+            pte = pgdir_walk(p->pgdir, (void*)a, 0);
+            if (pte && (*pte & PTE_P)) {
+                continue;
+            }
+            if (demand(p->pgdir, a, vma_perm(v, 1), v->start, v->end) < 0) {
+                vma_unmap(p, v);
+                vma_release(v);
+                return -1;
+            }
+        }
+    }
+    return addr;
+}
+
+/* Remove the mappings of [addr, addr + len). */
+int uvm_munmap(struct proc* p, uint64_t addr, uint64_t len)
+{
+    uint64_t end = ROUNDUP(addr + len, PGSIZE);
+
+    if (addr % PGSIZE || len == 0 || end < addr) {
+        return -1;
+    }
+    if (vma_clip(p, addr, end) < 0) {
+        return -1;
+    }
+    for (struct vma* v = p->vma; v < p->vma + NVMA; v++) {
+        if (v->end && v->start >= addr && v->end <= end) {
+            vma_unmap(p, v);
+            vma_release(v);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Change the access of the mappings in [addr, addr + len), which must
+ * all be mapped, to VMA_READ and VMA_WRITE in flags. Pages already
+ * mapped get new permissions; private writable ones become
+ * copy-on-write, since they may still be shared.
+ */
+int uvm_mprotect(struct proc* p, uint64_t addr, uint64_t len, int flags)
+{
+    uint64_t end = ROUNDUP(addr + len, PGSIZE), a, *pte, perm;
+    struct vma* v;
+
+    if (addr % PGSIZE || end < addr) {
+        return -1;
+    }
+    for (a = addr; a < end; a = v->end) {
+        if ((v = vma_find(p, a)) == 0) {
+            return -1;
+        }
+        if ((flags & VMA_WRITE) && !(v->flags & VMA_MAYWRITE)) {
+            return -1;
+        }
+    }
+    if (vma_clip(p, addr, end) < 0) {
+        return -1;
+    }
+
+    for (v = p->vma; v < p->vma + NVMA; v++) {
+        if (!v->end || v->start < addr || v->end > end) {
+            continue;
+        }
+        v->flags = (v->flags & ~(VMA_READ | VMA_WRITE)) | (flags & (VMA_READ | VMA_WRITE));
+        for (a = v->start; a < v->end; a += PGSIZE) {
+            pte = pgdir_walk(p->pgdir, (void*)a, 0);
+            if (pte && (*pte & PTE_P)) {
+                cont_split(p->pgdir, a);
+                perm = vma_perm(v, v->flags & VMA_SHARED);
+                // dirty pages of shared file mappings stay writable
+                if ((*pte & PTE_DIRTY) && (v->flags & VMA_WRITE)) {
+                    perm &= ~PTE_RO;
+                }
+                *pte = (*pte & ~(PTE_USER | PTE_RO | PTE_COW)) | perm;
+            }
+        }
+    }
+    tlb_shootdown(addr, end - addr);
+    return 0;
+}
+
+/*
+ * Drop all mappings of p, whose page table is about to be freed,
+ * writing shared file data back.
+ */
+void uvm_vma_free(struct proc* p)
+{
+    for (struct vma* v = p->vma; v < p->vma + NVMA; v++) {
+        if (v->end) {
+            if (vma_dirty(v)) {
+                vma_writeback(p, v, v->start, v->end);
+            }
+            vma_release(v);
+        }
+    }
+}
+
+/*
+ * Make the page at va, a copy-on-write page, writable by this
+ * address space. The page is copied unless nobody else shares it
+ * any more. Returns -1 if va is not copy-on-write or memory ran out.
+ */
+int uvm_cow(uint64_t* pgdir, uint64_t va)
+{
+    uint64_t* pte;
+    uint64_t pa, flags;
+    char* mem;
+
+    pte = pgdir_walk(pgdir, (void*)va, 0);
+    if (pte == 0 || !(*pte & PTE_P) || !(*pte & PTE_COW)) {
+        return -1;
+    }
+
+    cont_split(pgdir, va);
+    pa = PTE_ADDR(*pte);
+    flags = PTE_FLAGS(*pte) & ~(PTE_COW | PTE_RO);
+
+    if (page_shared((char*)P2V(pa))) {
+        if ((mem = kalloc_nozero()) == 0) {
+            return -1;
+        }
+        memmove(mem, (char*)P2V(pa), PGSIZE);
+        *pte = V2P(mem) | flags;
+        page_put((char*)P2V(pa));
+    } else {
+        *pte = pa | flags;
+    }
+    tlb_shootdown(va, PGSIZE);
+    return 0;
+}
+
+/*
+ * Copy the mappings of [start, end) of pgdir into d. Pages are shared
+ * instead of copied: unless shared, writable pages become read-only
+ * copy-on-write in both page tables, and the first write to one of
+ * them faults into uvm_cow().
+ */
+static int
+copy_range(uint64_t* pgdir, uint64_t* d, uint64_t start, uint64_t end, int shared)
+{
+    uint64_t* pte;
+    uint64_t pa, i;
+
+    for (i = start; i < end; i += PGSIZE) {
+        // pages that were never touched stay unmapped
         if ((pte = pgdir_walk(pgdir, (void*)i, 0)) == 0) {
-            panic("copyuvm: pte should exist");
+            i = ROUNDDOWN(i, BKSIZE) + BKSIZE - PGSIZE;
+            continue;
         }
 
         if (!(*pte & (PTE_PAGE | PTE_P))) {
-            panic("copyuvm: page not present");
+            continue;
         }
 
+        // a PTE_CONT run lies wholly in [start, end), so its
+        // entries all change alike and the child gets the run too
+        if (!shared && !(*pte & PTE_RO)) {
+            *pte |= PTE_RO | PTE_COW;
+        }
         pa = PTE_ADDR(*pte);
-        ap = *pte & (PTE_USER | PTE_RO);//not sure for the PTE_AP
 
-        if ((mem = kalloc()) == 0) {
-            goto bad;
+        if (map_region(d, (void*)i, PGSIZE, pa, PTE_FLAGS(*pte)) < 0) {
+            return -1;
         }
+        page_get((char*)P2V(pa));
+        cond_resched();
+    }
+    return 0;
+}
 
-        memmove(mem, (char*)P2V(pa), PGSIZE);
+/*
+ * Give a child a copy of the address space of p: the heap and program
+ * below p->sz and the mappings in the mmap area. Only the page tables
+ * are copied.
+ */
+uint64_t* copyuvm(struct proc* p)
+{
+    uint64_t* d;
+    struct vma* v;
+    int r;
 
-        if (map_region(d, (void*)i, PGSIZE, V2P(mem), ap) < 0) {
-            goto bad;
+    // allocate a new first level page directory
+    d = pgdir_init();
+    if (d == NULL) {
+        return NULL;
+    }
+
+    r = copy_range(p->pgdir, d, 0, p->sz, 0);
+    for (v = p->vma; v < p->vma + NVMA && r == 0; v++) {
+        if (v->end && v->start >= p->sz) {
+            r = copy_range(p->pgdir, d, v->start, v->end, v->flags & VMA_SHARED);
         }
     }
+    // our own writable mappings just became read-only
+    tlb_shootdown(0, MMAP_TOP);
+    if (r < 0) {
+        vm_free(d, 0);
+        return 0;
+    }
     return d;
-
-bad: kfree((char*)d);
-    return 0;
-}
\ No newline at end of file
+}
@@ -2,5 +2,9 @@
 #define DEFS_H
 
 void test_fork();
+void test_cow();
+void test_brk();
+void test_mmap();
+void test_clock();
 
 #endif
\ No newline at end of file
@@ -6,6 +6,10 @@ int
 main()
 {
     test_fork();
+    test_cow();
+    test_brk();
+    test_mmap();
+    test_clock();
 
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,37 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+
+#define HEAP_GROW (64 << 20)
+
+/* Growing the heap maps nothing until the pages are touched. */
+void
+test_brk()
+{
+    char *old, *new;
+
+    old = (char *)syscall(SYS_brk, 0);
+    new = (char *)syscall(SYS_brk, old + HEAP_GROW);
+    if (new != old + HEAP_GROW) {
+        printf("test_brk: brk failed\n");
+        return;
+    }
+
+    old[0] = 1;
+    new[-1] = 2;
+    if (fork() == 0) {
+        /* Untouched in the parent, so the child maps its own. */
+        old[HEAP_GROW / 2] = 3;
+        new[-1] = 4;
+        exit(0);
+    }
+    wait(NULL);
+    if (old[0] != 1 || new[-1] != 2 || old[HEAP_GROW / 2] != 0)
+        printf("test_brk: heap contents are wrong\n");
+    else
+        printf("test_brk: ok\n");
+
+    syscall(SYS_brk, old);
+}
@@ -0,0 +1,57 @@
+#include <stdio.h>
+#include <time.h>
+
+#include "vclock.h"
+
+static long long
+ns(struct timespec *ts)
+{
+    return ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+/* How far the clock page and the system call may be apart. */
+#define TOLERANCE_NS 1000000LL
+
+void
+test_clock()
+{
+    struct timespec a, b, c;
+    int n = 100000;
+
+    /*
+     * The clock page and the system call must agree and never go
+     * back. A preemption can separate the reads, so retry a few
+     * times before calling them too far apart.
+     */
+    for (int i = 0;; i++) {
+        vclock_gettime(CLOCK_MONOTONIC, &a);
+        clock_gettime(CLOCK_MONOTONIC, &b);
+        vclock_gettime(CLOCK_MONOTONIC, &c);
+        if (ns(&a) > ns(&b) || ns(&b) > ns(&c)) {
+            printf("test_clock: clocks disagree: %lld %lld %lld\n", ns(&a), ns(&b), ns(&c));
+            break;
+        }
+        if (ns(&c) - ns(&a) <= TOLERANCE_NS)
+            break;
+        if (i == 10) {
+            printf("test_clock: clocks %lld ns apart\n", ns(&c) - ns(&a));
+            break;
+        }
+    }
+
+    a = c;
+    for (int i = 0; i < n; i++) {
+        vclock_gettime(CLOCK_MONOTONIC, &b);
+        if (ns(&b) < ns(&a)) {
+            printf("test_clock: vclock_gettime went back from %lld to %lld\n", ns(&a), ns(&b));
+            return;
+        }
+        a = b;
+    }
+    printf("test_clock: vclock_gettime %lld ns/call\n", (ns(&b) - ns(&c)) / n);
+
+    vclock_gettime(CLOCK_MONOTONIC, &a);
+    for (int i = 0; i < n / 100; i++)
+        clock_gettime(CLOCK_MONOTONIC, &b);
+    printf("test_clock: clock_gettime %lld ns/call\n", (ns(&b) - ns(&a)) / (n / 100));
+}
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/wait.h>
 
@@ -23,4 +24,33 @@ test_fork()
         fork1();
     for (int i = 0; i < n; i++)
         wait(NULL);
-}
\ No newline at end of file
+}
+static char cow_buf[3 * 4096];
+
+/*
+ * Parent and child must keep private copies of pages shared
+ * copy-on-write, whether user code or a system call writes them.
+ */
+void
+test_cow()
+{
+    struct timespec *ts = (struct timespec *)(cow_buf + 4096);
+
+    memset(cow_buf, 'p', sizeof(cow_buf));
+    if (fork() == 0) {
+        cow_buf[0] = 'c';
+        /* clock_gettime() writes the page from the kernel. */
+        if (clock_gettime(CLOCK_MONOTONIC, ts) < 0 || cow_buf[0] != 'c' ||
+            cow_buf[2 * 4096] != 'p')
+            printf("test_cow: child copy is wrong\n");
+        exit(0);
+    }
+    wait(NULL);
+    for (int i = 0; i < sizeof(cow_buf); i++) {
+        if (cow_buf[i] != 'p') {
+            printf("test_cow: parent page changed at %d\n", i);
+            return;
+        }
+    }
+    printf("test_cow: ok\n");
+}
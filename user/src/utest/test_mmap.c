@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#define MAP_LEN (1 << 20)
+
+static void
+test_anon()
+{
+    char *priv, *shared;
+
+    priv = mmap(0, MAP_LEN, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    shared = mmap(0, 4096, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (priv == MAP_FAILED || shared == MAP_FAILED) {
+        printf("test_mmap: anonymous mmap failed\n");
+        return;
+    }
+    priv[0] = priv[MAP_LEN - 1] = 1;
+    if (fork() == 0) {
+        priv[0] = 2;
+        shared[0] = 2;
+        exit(0);
+    }
+    wait(NULL);
+    if (priv[0] != 1 || priv[MAP_LEN - 1] != 1 || priv[MAP_LEN / 2] != 0)
+        printf("test_mmap: private mapping is wrong\n");
+    if (shared[0] != 2)
+        printf("test_mmap: shared mapping is not shared\n");
+    if (mprotect(priv, MAP_LEN, PROT_READ) < 0 || priv[0] != 1)
+        printf("test_mmap: mprotect failed\n");
+    if (munmap(priv, MAP_LEN) < 0 || munmap(shared, 4096) < 0)
+        printf("test_mmap: munmap failed\n");
+}
+
+static void
+test_file()
+{
+    char buf[6] = {0}, *p, *q;
+    int fd, fd2;
+
+    if ((fd = open("/mmap_test", O_CREAT | O_RDWR)) < 0 || write(fd, "hello", 5) != 5) {
+        printf("test_mmap: cannot create /mmap_test\n");
+        return;
+    }
+    p = mmap(0, 5, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    q = mmap(0, 5, PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED || q == MAP_FAILED || memcmp(p, "hello", 5)) {
+        printf("test_mmap: file mapping is wrong\n");
+        close(fd);
+        return;
+    }
+
+    /* Both mappings, read() and write() see the same data. */
+    p[0] = 'j';
+    if (q[0] != 'j')
+        printf("test_mmap: shared mappings are not coherent\n");
+    fd2 = open("/mmap_test", O_RDWR);
+    if (fd2 < 0 || read(fd2, buf, 5) != 5 || strcmp(buf, "jello"))
+        printf("test_mmap: read() does not see a shared write\n");
+    close(fd2);
+    fd2 = open("/mmap_test", O_RDWR);
+    if (fd2 < 0 || write(fd2, "c", 1) != 1 || p[0] != 'c' || q[0] != 'c')
+        printf("test_mmap: write() does not reach the mappings\n");
+    close(fd2);
+    munmap(p, 5);
+    munmap(q, 5);
+    close(fd);
+
+    /* munmap() wrote the shared page back. */
+    fd = open("/mmap_test", O_RDONLY);
+    if (fd < 0 || read(fd, buf, 5) != 5 || strcmp(buf, "cello"))
+        printf("test_mmap: shared write did not reach the file\n");
+    close(fd);
+
+    /* write() leaves private mappings, like program text, alone. */
+    if ((fd = open("/mmap_priv", O_CREAT | O_RDWR)) < 0 || write(fd, "hello", 5) != 5) {
+        printf("test_mmap: cannot create /mmap_priv\n");
+        return;
+    }
+    p = mmap(0, 5, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED || p[0] != 'h') {
+        printf("test_mmap: private file mapping is wrong\n");
+    } else {
+        fd2 = open("/mmap_priv", O_RDWR);
+        if (fd2 < 0 || write(fd2, "j", 1) != 1 || p[0] != 'h')
+            printf("test_mmap: write() changed a private mapping\n");
+        close(fd2);
+        munmap(p, 5);
+    }
+    close(fd);
+}
+
+/*
+ * Large anonymous mappings are faulted in 64 KiB contiguous runs.
+ * Changing single pages of a run must leave its other pages alone.
+ */
+static void
+test_runs()
+{
+    int i, n = 32;
+    char *p;
+
+    p = mmap(0, n * 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        printf("test_mmap: mmap for runs failed\n");
+        return;
+    }
+    for (i = 0; i < n; i++)
+        p[i * 4096] = i;
+    if (fork() == 0) {
+        p[4 * 4096] = 100;
+        if (p[4 * 4096] != 100 || p[5 * 4096] != 5)
+            printf("test_mmap: child copy of a run is wrong\n");
+        exit(0);
+    }
+    wait(NULL);
+    if (munmap(p + 3 * 4096, 4096) < 0 || mprotect(p + 6 * 4096, 4096, PROT_READ) < 0)
+        printf("test_mmap: munmap or mprotect in a run failed\n");
+    p[7 * 4096] = 107;
+    for (i = 0; i < n; i++) {
+        if (i != 3 && p[i * 4096] != (i == 7 ? 107 : i)) {
+            printf("test_mmap: page %d of a run is wrong\n", i);
+            break;
+        }
+    }
+}
+
+void
+test_mmap()
+{
+    test_anon();
+    test_runs();
+    test_file();
+    printf("test_mmap: done\n");
+}